@@ -29,9 +29,14 @@
 #include "include/proxy-wasm/null_plugin.h"
 
 using proxy_wasm::WasmHeaderMapType;
+using proxy_wasm::WasmResult;
 using proxy_wasm::null_plugin::getHeaderMapValue;
 using proxy_wasm::null_plugin::getProperty;
 using proxy_wasm::null_plugin::getValue;
+using proxy_wasm::null_plugin::proxy_get_property;
+using proxy_wasm::null_plugin::setFilterState;
+using proxy_wasm::null_plugin::WasmData;
+using proxy_wasm::null_plugin::WasmDataPtr;
 
 #endif  // NULL_PLUGIN
 
@@ -52,35 +57,280 @@ constexpr std::string_view GrpcStatsName = "envoy.filters.http.grpc_stats";
 
 namespace {
 
+// PropertyPath is a property path serialized once into the host encoding, in
+// which every part is terminated by a NUL character. getProperty() serializes
+// the path into a temporary buffer on every call instead.
+class PropertyPath {
+ public:
+  explicit PropertyPath(std::initializer_list<std::string_view> parts) {
+    for (const auto& part : parts) {
+      path_.append(part.data(), part.size());
+      path_.push_back('\0');
+    }
+  }
+
+  std::optional<WasmDataPtr> get() const {
+    const char* value_ptr = nullptr;
+    size_t value_size = 0;
+    if (proxy_get_property(path_.data(), path_.size(), &value_ptr,
+                           &value_size) != WasmResult::Ok) {
+      return {};
+    }
+    return std::make_unique<WasmData>(value_ptr, value_size);
+  }
+
+  // Reads the value into a buffer owned by the caller.
+  bool get(HostBuffer* out) const {
+    const char* value_ptr = nullptr;
+    size_t value_size = 0;
+    if (proxy_get_property(path_.data(), path_.size(), &value_ptr,
+                           &value_size) != WasmResult::Ok) {
+      return false;
+    }
+    *out = HostBuffer(value_ptr, value_size);
+    return true;
+  }
+
+  // Reads a fixed size value, with the same semantics as getValue().
+  template <typename T>
+  bool getValue(T* out) const {
+    auto buf = get();
+    if (!buf.has_value() || buf.value()->size() != sizeof(T)) {
+      return false;
+    }
+    *out = *reinterpret_cast<const T*>(buf.value()->data());
+    return true;
+  }
+
+ private:
+  std::string path_;
+};
+
+template <typename Info>
+bool getStringValue(const PropertyPath& path, Info* request_info,
+                    typename Info::StringType* field) {
+  auto buf = path.get();
+  if (!buf.has_value()) {
+    return false;
+  }
+  setStringValue(request_info, field, buf.value()->view());
+  return true;
+}
+
+// StringProperty binds a property path to the string field it populates.
+template <typename Info>
+struct StringProperty {
+  PropertyPath path;
+  typename Info::StringType Info::*field;
+};
+
+template <typename Info>
+using StringProperties = std::vector<StringProperty<Info>>;
+
+// Fetches a precompiled list of properties into their fields. Missing
+// properties leave the fields untouched.
+template <typename Info>
+void getStringValues(const StringProperties<Info>& properties,
+                     Info* request_info) {
+  for (const auto& property : properties) {
+    getStringValue(property.path, request_info,
+                   &(request_info->*property.field));
+  }
+}
+
+// Property paths read by the populate functions.
+const PropertyPath kRequestInfoPath{kRequestInfoKey};
+const PropertyPath kClusterNamePath{"cluster_name"};
+const PropertyPath kRouteNamePath{"route_name"};
+const PropertyPath kUpstreamPeerPrincipalPath{"upstream",
+                                              "uri_san_peer_certificate"};
+const PropertyPath kUpstreamLocalPrincipalPath{"upstream",
+                                               "uri_san_local_certificate"};
+const PropertyPath kConnectionPeerPrincipalPath{"connection",
+                                                "uri_san_peer_certificate"};
+const PropertyPath kConnectionLocalPrincipalPath{"connection",
+                                                 "uri_san_local_certificate"};
+const PropertyPath kServiceNamePath{"cluster_metadata", "filter_metadata",
+                                    "istio", "services", "0", "name"};
+const PropertyPath kServiceHostPath{"cluster_metadata", "filter_metadata",
+                                    "istio", "services", "0", "host"};
+const PropertyPath kUpstreamPortPath{"upstream", "port"};
+const PropertyPath kDestinationPortPath{"destination", "port"};
+const PropertyPath kMtlsPath{"connection", "mtls"};
+const PropertyPath kRequestUrlPathPath{"request", "url_path"};
+const PropertyPath kResponseCodePath{"response", "code"};
+const PropertyPath kResponseFlagsPath{"response", "flags"};
+const PropertyPath kGrpcStatusPath{"response", "grpc_status"};
+const PropertyPath kRequestOperationPath{kRequestOperationKey};
+const PropertyPath kRequestTimePath{"request", "time"};
+const PropertyPath kRequestDurationPath{"request", "duration"};
+const PropertyPath kRequestSizePath{"request", "total_size"};
+const PropertyPath kResponseSizePath{"response", "total_size"};
+const PropertyPath kTraceSampledPath{"request", "headers", "x-b3-sampled"};
+const PropertyPath kResponseDetailsPath{"response", "code_details"};
+const PropertyPath kSourcePortPath{"source", "port"};
+const PropertyPath kConnectionIdPath{"connection_id"};
+const PropertyPath kTerminationDetailsPath{"connection",
+                                           "termination_details"};
+const PropertyPath kGrpcStatsPath{"filter_state", GrpcStatsName};
+
+template <typename Info>
+const StringProperties<Info>& extendedHttpProperties() {
+  static const StringProperties<Info> properties = {
+      {PropertyPath{"request", "referer"}, &Info::referer},
+      {PropertyPath{"request", "useragent"}, &Info::user_agent},
+      {PropertyPath{"request", "id"}, &Info::request_id},
+      {PropertyPath{"request", "url_path"}, &Info::url_path},
+      {PropertyPath{"request", "host"}, &Info::url_host},
+      {PropertyPath{"request", "scheme"}, &Info::url_scheme},
+  };
+  return properties;
+}
+
+template <typename Info>
+const StringProperties<Info>& traceProperties() {
+  static const StringProperties<Info> properties = {
+      {PropertyPath{"request", "headers", "x-b3-traceid"}, &Info::b3_trace_id},
+      {PropertyPath{"request", "headers", "x-b3-spanid"}, &Info::b3_span_id},
+  };
+  return properties;
+}
+
+template <typename Info>
+const StringProperties<Info>& extendedProperties() {
+  static const StringProperties<Info> properties = {
+      {PropertyPath{"source", "address"}, &Info::source_address},
+      {PropertyPath{"destination", "address"}, &Info::destination_address},
+      {PropertyPath{"upstream", "address"}, &Info::upstream_host},
+      {PropertyPath{"connection", "requested_server_name"},
+       &Info::requested_server_name},
+      {PropertyPath{"upstream", "transport_failure_reason"},
+       &Info::upstream_transport_failure_reason},
+  };
+  return properties;
+}
+
+// Copies a string property into the builder. Returns false if the property is
+// not available.
+bool createString(flatbuffers::FlatBufferBuilder& fbb, const PropertyPath& path,
+                  flatbuffers::Offset<flatbuffers::String>* out) {
+  auto buf = path.get();
+  if (!buf.has_value()) {
+    return false;
+  }
+  *out = fbb.CreateString(buf.value()->data(), buf.value()->size());
+  return true;
+}
+
+// Returns true if the destination service is derived from the route or
+// cluster name alone, without the cluster metadata.
+bool isInternalDestination(std::string_view route_name,
+                           std::string_view cluster_name) {
+  return route_name == kBlackHoleRouteName ||
+         route_name == kPassThroughRouteName ||
+         cluster_name == kBlackHoleCluster ||
+         cluster_name == kPassThroughCluster ||
+         cluster_name == kInboundPassthroughClusterIpv4 ||
+         cluster_name == kInboundPassthroughClusterIpv6;
+}
+
+// Fetches the properties read by populateRequestInfo from the host.
+flatbuffers::DetachedBuffer fetchRequestProperties(bool outbound) {
+  flatbuffers::FlatBufferBuilder fbb;
+  flatbuffers::Offset<flatbuffers::String> upstream_cluster, route_name,
+      source_principal, destination_principal, service_name, service_host;
+  auto cluster = kClusterNamePath.get();
+  auto route = kRouteNamePath.get();
+  std::string_view cluster_view, route_view;
+  if (cluster.has_value()) {
+    cluster_view = cluster.value()->view();
+    upstream_cluster = fbb.CreateString(cluster_view);
+  }
+  if (route.has_value()) {
+    route_view = route.value()->view();
+    route_name = fbb.CreateString(route_view);
+  }
+  if (!isInternalDestination(route_view, cluster_view) &&
+      createString(fbb, kServiceNamePath, &service_name)) {
+    createString(fbb, kServiceHostPath, &service_host);
+  }
+
+  uint64_t destination_port = 0;
+  auto service_auth_policy = ServiceAuthenticationPolicy::Unspecified;
+  if (outbound) {
+    kUpstreamPortPath.getValue(&destination_port);
+    createString(fbb, kUpstreamPeerPrincipalPath, &destination_principal);
+    createString(fbb, kUpstreamLocalPrincipalPath, &source_principal);
+  } else {
+    kDestinationPortPath.getValue(&destination_port);
+    bool mtls = false;
+    if (kMtlsPath.getValue(&mtls)) {
+      service_auth_policy = mtls ? ServiceAuthenticationPolicy::MutualTLS
+                                 : ServiceAuthenticationPolicy::None;
+    }
+    createString(fbb, kConnectionLocalPrincipalPath, &destination_principal);
+    createString(fbb, kConnectionPeerPrincipalPath, &source_principal);
+  }
+
+  FlatRequestInfoBuilder properties(fbb);
+  properties.add_outbound(outbound);
+  properties.add_upstream_cluster(upstream_cluster);
+  properties.add_route_name(route_name);
+  properties.add_source_principal(source_principal);
+  properties.add_destination_principal(destination_principal);
+  properties.add_service_name(service_name);
+  properties.add_service_host(service_host);
+  properties.add_destination_port(destination_port);
+  properties.add_service_auth_policy(
+      static_cast<uint8_t>(service_auth_policy));
+  properties.add_version(kRequestInfoVersion);
+  auto data = properties.Finish();
+  fbb.Finish(data);
+  return fbb.Release();
+}
+
+template <typename Info>
+void setStringValue(Info* request_info, typename Info::StringType* field,
+                    const flatbuffers::String* value) {
+  if (value) {
+    setStringValue(request_info, field, GetStringView(value));
+  }
+}
+
 // Get destination service host and name based on destination cluster metadata
 // and host header.
 // * If cluster name is one of passthrough and blackhole clusters, use cluster
 //   name as destination service name and host header as destination host.
-// * Otherwise, try fetching cluster metadata for destination service name and
+// * Otherwise, use the cluster metadata for destination service name and
 //   host. If cluster metadata is not available, set destination service name
 //   the same as destination service host.
-void populateDestinationService(bool use_host_header,
-                                RequestInfo* request_info) {
-  request_info->destination_service_host =
-      use_host_header ? request_info->url_host : "unknown";
+template <typename Info>
+void populateDestinationService(const FlatRequestInfo& properties,
+                                bool use_host_header, Info* request_info) {
+  setStringValue(request_info, &request_info->destination_service_host,
+                 use_host_header ? std::string_view(request_info->url_host)
+                                 : "unknown");
 
   // override the cluster name if this is being sent to the
   // blackhole or passthrough cluster
-  const std::string& route_name = request_info->route_name;
+  const std::string_view route_name = request_info->route_name;
   if (route_name == kBlackHoleRouteName) {
-    request_info->destination_service_name = kBlackHoleCluster;
+    setStringValue(request_info, &request_info->destination_service_name,
+                   kBlackHoleCluster);
     return;
   } else if (route_name == kPassThroughRouteName) {
-    request_info->destination_service_name = kPassThroughCluster;
+    setStringValue(request_info, &request_info->destination_service_name,
+                   kPassThroughCluster);
     return;
   }
 
-  const std::string& cluster_name = request_info->upstream_cluster;
+  const std::string_view cluster_name = request_info->upstream_cluster;
   if (cluster_name == kBlackHoleCluster ||
       cluster_name == kPassThroughCluster ||
       cluster_name == kInboundPassthroughClusterIpv4 ||
       cluster_name == kInboundPassthroughClusterIpv6) {
-    request_info->destination_service_name = cluster_name;
+    setStringValue(request_info, &request_info->destination_service_name,
+                   cluster_name);
     return;
   }
 
@@ -100,60 +350,95 @@ void populateDestinationService(bool use_host_header,
   // oldest service) to get destination service information. Ideally client will
   // forward the canonical host to the server side so that it could accurately
   // identify the intended host.
-  if (getValue({"cluster_metadata", "filter_metadata", "istio", "services", "0",
-                "name"},
-               &request_info->destination_service_name)) {
-    getValue({"cluster_metadata", "filter_metadata", "istio", "services", "0",
-              "host"},
-             &request_info->destination_service_host);
+  if (properties.service_name()) {
+    setStringValue(request_info, &request_info->destination_service_name,
+                   properties.service_name());
+    setStringValue(request_info, &request_info->destination_service_host,
+                   properties.service_host());
   } else {
     // if cluster metadata cannot be found, fallback to destination service
     // host. If host header fallback is enabled, this will be host header. If
     // host header fallback is disabled, this will be unknown. This could happen
     // if a request does not route to any cluster.
-    request_info->destination_service_name =
-        request_info->destination_service_host;
+    setStringValue(request_info, &request_info->destination_service_name,
+                   request_info->destination_service_host);
   }
 }
 
 }  // namespace
 
+bool getStringValue(std::initializer_list<std::string_view> path,
+                    RequestInfo*, std::string* field) {
+  return getValue(path, field);
+}
+
+bool getStringValue(std::initializer_list<std::string_view> path,
+                    ArenaRequestInfo* request_info, std::string_view* field) {
+  auto buf = getProperty(path);
+  if (!buf.has_value()) {
+    return false;
+  }
+  setStringValue(request_info, field, buf.value()->view());
+  return true;
+}
+
+template <typename Info>
 void populateRequestInfo(bool outbound, bool use_host_header_fallback,
-                         RequestInfo* request_info) {
+                         Info* request_info) {
   if (request_info->is_populated) {
     return;
   }
 
   request_info->is_populated = true;
 
-  getValue({"cluster_name"}, &request_info->upstream_cluster);
-  getValue({"route_name"}, &request_info->route_name);
+  // Reuse the properties fetched by another telemetry plugin of the stream,
+  // or fetch and share them.
+  auto shared = kRequestInfoPath.get();
+  flatbuffers::DetachedBuffer fetched;
+  const FlatRequestInfo* properties = nullptr;
+  if (shared.has_value() && shared.value()->size() > 0) {
+    // The sharing plugin may be built from another schema, in which case the
+    // properties are fetched again.
+    flatbuffers::Verifier verifier(
+        reinterpret_cast<const uint8_t*>(shared.value()->data()),
+        shared.value()->size());
+    if (verifier.VerifyBuffer<FlatRequestInfo>(nullptr)) {
+      properties =
+          flatbuffers::GetRoot<FlatRequestInfo>(shared.value()->data());
+      if (properties->version() != kRequestInfoVersion ||
+          properties->outbound() != outbound) {
+        properties = nullptr;
+      }
+    }
+  }
+  if (properties == nullptr) {
+    fetched = fetchRequestProperties(outbound);
+    setFilterState(
+        kRequestInfoKey,
+        std::string_view(reinterpret_cast<const char*>(fetched.data()),
+                         fetched.size()));
+    properties = flatbuffers::GetRoot<FlatRequestInfo>(fetched.data());
+  }
+
+  setStringValue(request_info, &request_info->upstream_cluster,
+                 properties->upstream_cluster());
+  setStringValue(request_info, &request_info->route_name,
+                 properties->route_name());
+  setStringValue(request_info, &request_info->source_principal,
+                 properties->source_principal());
+  setStringValue(request_info, &request_info->destination_principal,
+                 properties->destination_principal());
   // Fill in request info.
   // Get destination service name and host based on cluster name and host
   // header.
-  populateDestinationService(use_host_header_fallback, request_info);
-  uint64_t destination_port = 0;
-  if (outbound) {
-    getValue({"upstream", "port"}, &destination_port);
-    getValue({"upstream", "uri_san_peer_certificate"},
-             &request_info->destination_principal);
-    getValue({"upstream", "uri_san_local_certificate"},
-             &request_info->source_principal);
-  } else {
-    getValue({"destination", "port"}, &destination_port);
-
-    bool mtls = false;
-    if (getValue({"connection", "mtls"}, &mtls)) {
-      request_info->service_auth_policy =
-          mtls ? ::Wasm::Common::ServiceAuthenticationPolicy::MutualTLS
-               : ::Wasm::Common::ServiceAuthenticationPolicy::None;
-    }
-    getValue({"connection", "uri_san_local_certificate"},
-             &request_info->destination_principal);
-    getValue({"connection", "uri_san_peer_certificate"},
-             &request_info->source_principal);
+  populateDestinationService(*properties, use_host_header_fallback,
+                             request_info);
+  request_info->destination_port = properties->destination_port();
+  auto service_auth_policy = static_cast<ServiceAuthenticationPolicy>(
+      properties->service_auth_policy());
+  if (service_auth_policy != ServiceAuthenticationPolicy::Unspecified) {
+    request_info->service_auth_policy = service_auth_policy;
   }
-  request_info->destination_port = destination_port;
 }
 
 std::string_view AuthenticationPolicyString(
@@ -330,13 +615,15 @@ bool extractPeerMetadataFromUpstreamHostMetadata(
 PeerNodeInfo::PeerNodeInfo(const std::string_view peer_metadata_id_key,
                            const std::string_view peer_metadata_key) {
   // Attempt to read from filter_state first.
-  found_ = getValue({peer_metadata_id_key}, &peer_id_);
-  if (found_ && peer_id_ != kMetadataNotFoundValue) {
-    getValue({peer_metadata_key}, &peer_node_);
+  found_ = PropertyPath{peer_metadata_id_key}.get(&peer_id_);
+  if (found_ && id() != kMetadataNotFoundValue &&
+      PropertyPath{peer_metadata_key}.get(&peer_node_) &&
+      peer_node_.size() > 0) {
     return;
   }
 
-  // Sentinel value is preserved as ID to implement maybeWaiting.
+  // Sentinel value is preserved as ID to implement maybeWaiting. An ID without
+  // metadata is not found either and gets the fallback node below.
   found_ = false;
 
   // Downstream peer metadata will never be in localhost endpoint. Skip
@@ -358,8 +645,7 @@ PeerNodeInfo::PeerNodeInfo(const std::string_view peer_metadata_id_key,
 
 const ::Wasm::Common::FlatNode& PeerNodeInfo::get() const {
   if (found_) {
-    return *flatbuffers::GetRoot<::Wasm::Common::FlatNode>(
-        reinterpret_cast<const uint8_t*>(peer_node_.data()));
+    return *flatbuffers::GetRoot<::Wasm::Common::FlatNode>(peer_node_.data());
   }
   return *flatbuffers::GetRoot<::Wasm::Common::FlatNode>(
       fallback_peer_node_.data());
@@ -367,41 +653,52 @@ const ::Wasm::Common::FlatNode& PeerNodeInfo::get() const {
 
 // Host header is used if use_host_header_fallback==true.
 // Normally it is ok to use host header within the mesh, but not at ingress.
+template <typename Info>
 void populateHTTPRequestInfo(bool outbound, bool use_host_header_fallback,
-                             RequestInfo* request_info) {
+                             Info* request_info, uint32_t fields) {
   populateRequestProtocol(request_info);
-  getValue({"request", "url_path"}, &request_info->request_url_path);
+  if (hasRequestField(fields, RequestField::RequestUrlPath)) {
+    getStringValue(kRequestUrlPathPath, request_info,
+                   &request_info->request_url_path);
+  }
   populateRequestInfo(outbound, use_host_header_fallback, request_info);
 
   int64_t response_code = 0;
-  if (getValue({"response", "code"}, &response_code)) {
+  if (kResponseCodePath.getValue(&response_code)) {
     request_info->response_code = response_code;
   }
 
   uint64_t response_flags = 0;
-  if (getValue({"response", "flags"}, &response_flags)) {
-    request_info->response_flag = parseResponseFlag(response_flags);
+  if (hasRequestField(fields, RequestField::ResponseFlag) &&
+      kResponseFlagsPath.getValue(&response_flags)) {
+    setStringValue(request_info, &request_info->response_flag,
+                   parseResponseFlag(response_flags));
   }
 
   if (request_info->request_protocol == Protocol::GRPC) {
     int64_t grpc_status_code = 2;
-    getValue({"response", "grpc_status"}, &grpc_status_code);
+    kGrpcStatusPath.getValue(&grpc_status_code);
     request_info->grpc_status = grpc_status_code;
     populateGRPCInfo(request_info);
   }
 
-  std::string operation_id;
-  request_info->request_operation =
-      getValue({::Wasm::Common::kRequestOperationKey}, &operation_id)
-          ? operation_id
-          : getHeaderMapValue(WasmHeaderMapType::RequestHeaders,
-                              kMethodHeaderKey)
-                ->toString();
+  if (hasRequestField(fields, RequestField::RequestOperation) &&
+      !getStringValue(kRequestOperationPath, request_info,
+                      &request_info->request_operation)) {
+    setStringValue(
+        request_info, &request_info->request_operation,
+        getHeaderMapValue(WasmHeaderMapType::RequestHeaders, kMethodHeaderKey)
+            ->view());
+  }
 
-  getValue({"request", "time"}, &request_info->start_time);
-  getValue({"request", "duration"}, &request_info->duration);
-  getValue({"request", "total_size"}, &request_info->request_size);
-  getValue({"response", "total_size"}, &request_info->response_size);
+  if (hasRequestField(fields, RequestField::Timing)) {
+    kRequestTimePath.getValue(&request_info->start_time);
+    kRequestDurationPath.getValue(&request_info->duration);
+  }
+  if (hasRequestField(fields, RequestField::Sizes)) {
+    kRequestSizePath.getValue(&request_info->request_size);
+    kResponseSizePath.getValue(&request_info->response_size);
+  }
 }
 
 std::string_view nodeInfoSchema() {
@@ -410,69 +707,66 @@ std::string_view nodeInfoSchema() {
       FlatNodeBinarySchema::size());
 }
 
-void populateExtendedHTTPRequestInfo(RequestInfo* request_info) {
+template <typename Info>
+void populateExtendedHTTPRequestInfo(Info* request_info) {
   populateExtendedRequestInfo(request_info);
 
-  getValue({"request", "referer"}, &request_info->referer);
-  getValue({"request", "useragent"}, &request_info->user_agent);
-  getValue({"request", "id"}, &request_info->request_id);
-  std::string trace_sampled;
-  if (getValue({"request", "headers", "x-b3-sampled"}, &trace_sampled) &&
-      trace_sampled == "1") {
-    getValue({"request", "headers", "x-b3-traceid"},
-             &request_info->b3_trace_id);
-    getValue({"request", "headers", "x-b3-spanid"}, &request_info->b3_span_id);
+  // Referer, user agent, request ID and URL.
+  getStringValues(extendedHttpProperties<Info>(), request_info);
+  auto trace_sampled = kTraceSampledPath.get();
+  if (trace_sampled.has_value() && trace_sampled.value()->view() == "1") {
+    getStringValues(traceProperties<Info>(), request_info);
     request_info->b3_trace_sampled = true;
   }
 
-  getValue({"request", "url_path"}, &request_info->url_path);
-  getValue({"request", "host"}, &request_info->url_host);
-  getValue({"request", "scheme"}, &request_info->url_scheme);
-  std::string response_details;
-  getValue({"response", "code_details"}, &response_details);
-  if (!response_details.empty()) {
-    request_info->response_details = response_details;
+  auto response_details = kResponseDetailsPath.get();
+  if (response_details.has_value() && response_details.value()->size() > 0) {
+    setStringValue(request_info, &request_info->response_details,
+                   response_details.value()->view());
   }
 }
 
-void populateExtendedRequestInfo(RequestInfo* request_info) {
-  getValue({"source", "address"}, &request_info->source_address);
-  getValue({"destination", "address"}, &request_info->destination_address);
-  getValue({"source", "port"}, &request_info->source_port);
-  getValue({"connection_id"}, &request_info->connection_id);
-  getValue({"upstream", "address"}, &request_info->upstream_host);
-  getValue({"connection", "requested_server_name"},
-           &request_info->requested_server_name);
+template <typename Info>
+void populateExtendedRequestInfo(Info* request_info) {
+  // Addresses, SNI and upstream transport failure reason.
+  getStringValues(extendedProperties<Info>(), request_info);
+  kSourcePortPath.getValue(&request_info->source_port);
+  kConnectionIdPath.getValue(&request_info->connection_id);
   auto envoy_original_path = getHeaderMapValue(
       WasmHeaderMapType::RequestHeaders, kEnvoyOriginalPathKey);
-  request_info->x_envoy_original_path =
-      envoy_original_path ? envoy_original_path->toString() : "";
+  setStringValue(
+      request_info, &request_info->x_envoy_original_path,
+      envoy_original_path ? envoy_original_path->view() : std::string_view());
   auto envoy_original_dst_host = getHeaderMapValue(
       WasmHeaderMapType::RequestHeaders, kEnvoyOriginalDstHostKey);
-  request_info->x_envoy_original_dst_host =
-      envoy_original_dst_host ? envoy_original_dst_host->toString() : "";
-  getValue({"upstream", "transport_failure_reason"},
-           &request_info->upstream_transport_failure_reason);
-  std::string response_details;
-  getValue({"connection", "termination_details"}, &response_details);
-  if (!response_details.empty()) {
-    request_info->response_details = response_details;
+  setStringValue(request_info, &request_info->x_envoy_original_dst_host,
+                 envoy_original_dst_host ? envoy_original_dst_host->view()
+                                         : std::string_view());
+  auto response_details = kTerminationDetailsPath.get();
+  if (response_details.has_value() && response_details.value()->size() > 0) {
+    setStringValue(request_info, &request_info->response_details,
+                   response_details.value()->view());
   }
 }
 
-void populateTCPRequestInfo(bool outbound, RequestInfo* request_info) {
+template <typename Info>
+void populateTCPRequestInfo(bool outbound, Info* request_info,
+                            uint32_t fields) {
   // host_header_fallback is for HTTP/gRPC only.
   populateRequestInfo(outbound, false, request_info);
 
   uint64_t response_flags = 0;
-  if (getValue({"response", "flags"}, &response_flags)) {
-    request_info->response_flag = parseResponseFlag(response_flags);
+  if (hasRequestField(fields, RequestField::ResponseFlag) &&
+      kResponseFlagsPath.getValue(&response_flags)) {
+    setStringValue(request_info, &request_info->response_flag,
+                   parseResponseFlag(response_flags));
   }
 
   request_info->request_protocol = Protocol::TCP;
 }
 
-void populateRequestProtocol(RequestInfo* request_info) {
+template <typename Info>
+void populateRequestProtocol(Info* request_info) {
   if (kGrpcContentTypes.count(
           getHeaderMapValue(WasmHeaderMapType::RequestHeaders,
                             kContentTypeHeaderKey)
@@ -485,11 +779,13 @@ void populateRequestProtocol(RequestInfo* request_info) {
   }
 }
 
-bool populateGRPCInfo(RequestInfo* request_info) {
-  std::string value;
-  if (!getValue({"filter_state", GrpcStatsName}, &value)) {
+template <typename Info>
+bool populateGRPCInfo(Info* request_info) {
+  auto buf = kGrpcStatsPath.get();
+  if (!buf.has_value()) {
     return false;
   }
+  std::string_view value = buf.value()->view();
   // The expected byte serialization of grpc_stats filter is "x,y" where "x"
   // is the request message count and "y" is the response message count.
   std::vector<std::string_view> parts = absl::StrSplit(value, ',');
@@ -511,5 +807,20 @@ bool getAuditPolicy() {
   return shouldAudit;
 }
 
+// Instantiations for the supported request info variants.
+#define INSTANTIATE_POPULATE_FUNCTIONS(Info)                                  \
+  template void populateRequestInfo(bool, bool, Info*);                       \
+  template void populateHTTPRequestInfo(bool, bool, Info*, uint32_t);         \
+  template void populateExtendedHTTPRequestInfo(Info*);                       \
+  template void populateExtendedRequestInfo(Info*);                           \
+  template void populateTCPRequestInfo(bool, Info*, uint32_t);                \
+  template void populateRequestProtocol(Info*);                               \
+  template bool populateGRPCInfo(Info*);
+
+INSTANTIATE_POPULATE_FUNCTIONS(RequestInfo)
+INSTANTIATE_POPULATE_FUNCTIONS(ArenaRequestInfo)
+
+#undef INSTANTIATE_POPULATE_FUNCTIONS
+
 }  // namespace Common
 }  // namespace Wasm
@@ -15,9 +15,12 @@
 
 #pragma once
 
+#include <cstdlib>
+#include <memory>
 #include <set>
 
 #include "extensions/common/node_info_generated.h"
+#include "extensions/common/util.h"
 #include "flatbuffers/flatbuffers.h"
 
 namespace Wasm {
@@ -39,6 +42,11 @@ const std::string kMetadataNotFoundValue =
     "envoy.wasm.metadata_exchange.peer_unknown";
 
 constexpr std::string_view kAccessLogPolicyKey = "istio.access_log_policy";
+// Filter state key of the FlatRequestInfo shared by the telemetry plugins.
+constexpr std::string_view kRequestInfoKey = "istio.request_info";
+// Version of the shared FlatRequestInfo, bumped when the meaning of its
+// fields changes.
+constexpr uint32_t kRequestInfoVersion = 1;
 constexpr std::string_view kRequestOperationKey = "istio_operationId";
 
 // Header keys
@@ -82,6 +90,25 @@ enum class Protocol : uint32_t {
   GRPC = 0x4,
 };
 
+// Request info fields which callers may not need. The populate functions skip
+// fetching the fields missing from the mask passed by the caller, which is
+// computed once per configuration.
+enum class RequestField : uint32_t {
+  RequestUrlPath = 0x1,
+  RequestOperation = 0x2,
+  ResponseFlag = 0x4,
+  // Start time and duration.
+  Timing = 0x8,
+  // Request and response total sizes.
+  Sizes = 0x10,
+};
+
+constexpr uint32_t kAllRequestFields = ~0u;
+
+inline bool hasRequestField(uint32_t fields, RequestField field) {
+  return (fields & static_cast<uint32_t>(field)) != 0;
+}
+
 constexpr std::string_view kMutualTLS = "MUTUAL_TLS";
 constexpr std::string_view kNone = "NONE";
 constexpr std::string_view kOpen = "OPEN";
@@ -95,9 +122,13 @@ std::string_view ProtocolString(Protocol protocol);
 // None response flag.
 const std::string NONE = "-";
 
-// RequestInfo represents the information collected from filter stream
-// callbacks. This is used to fill metrics and logs.
-struct RequestInfo {
+// BasicRequestInfo represents the information collected from filter stream
+// callbacks. This is used to fill metrics and logs. String is the type of the
+// string fields, see RequestInfo and ArenaRequestInfo below.
+template <typename String>
+struct BasicRequestInfo {
+  using StringType = String;
+
   // Start timestamp in nanoseconds.
   int64_t start_time;
 
@@ -127,21 +158,21 @@ struct RequestInfo {
 
   // Response flag giving additional information - NR, UAEX etc.
   // TODO populate
-  std::string response_flag;
+  String response_flag;
 
   // Host name of destination service.
-  std::string destination_service_host;
+  String destination_service_host;
 
   // Short name of destination service.
-  std::string destination_service_name;
+  String destination_service_name;
 
   // Operation of the request, i.e. HTTP method or gRPC API method.
-  std::string request_operation;
+  String request_operation;
 
   // The path portion of the URL without the query string.
-  std::string request_url_path;
+  String request_url_path;
 
-  std::string upstream_transport_failure_reason;
+  String upstream_transport_failure_reason;
 
   // Service authentication policy (NONE, MUTUAL_TLS)
   ServiceAuthenticationPolicy service_auth_policy =
@@ -149,38 +180,38 @@ struct RequestInfo {
 
   // Principal of source and destination workload extracted from TLS
   // certificate.
-  std::string source_principal;
-  std::string destination_principal;
+  String source_principal;
+  String destination_principal;
 
   // Connection id of the TCP connection.
   uint64_t connection_id;
 
   // The following fields will only be populated by calling
   // populateExtendedHTTPRequestInfo.
-  std::string source_address;
-  std::string destination_address;
-  std::string response_details;
+  String source_address;
+  String destination_address;
+  String response_details;
 
   // Additional fields for access log.
-  std::string route_name;
-  std::string upstream_host;
-  std::string upstream_cluster;
-  std::string requested_server_name;
-  std::string x_envoy_original_path;
-  std::string x_envoy_original_dst_host;
+  String route_name;
+  String upstream_host;
+  String upstream_cluster;
+  String requested_server_name;
+  String x_envoy_original_path;
+  String x_envoy_original_dst_host;
 
   // Important Headers.
-  std::string referer;
-  std::string user_agent;
-  std::string request_id;
-  std::string b3_trace_id;
-  std::string b3_span_id;
+  String referer;
+  String user_agent;
+  String request_id;
+  String b3_trace_id;
+  String b3_span_id;
   bool b3_trace_sampled = false;
 
   // HTTP URL related attributes.
-  std::string url_path;
-  std::string url_host;
-  std::string url_scheme;
+  String url_path;
+  String url_host;
+  String url_scheme;
 
   // TCP variables.
   uint8_t tcp_connections_opened = 0;
@@ -201,6 +232,38 @@ struct RequestInfo {
   uint64_t last_response_message_count = 0;
 };
 
+// RequestInfo owns its string fields.
+using RequestInfo = BasicRequestInfo<std::string>;
+
+// ArenaRequestInfo keeps its string fields in a per-stream arena, so that a
+// stream populates all of them with one allocation. The views are valid for
+// the lifetime of the request info, which is therefore not copyable.
+struct ArenaRequestInfo : public BasicRequestInfo<std::string_view> {
+  StringArena arena;
+};
+
+// Stores a value in a string field of the request info.
+inline void setStringValue(RequestInfo*, std::string* field,
+                           std::string_view value) {
+  field->assign(value.data(), value.size());
+}
+
+inline void setStringValue(ArenaRequestInfo* request_info,
+                           std::string_view* field, std::string_view value) {
+  // Rewriting an unchanged value, e.g. a response flag on every tick of a
+  // long lived connection, must not grow the arena.
+  if (*field != value) {
+    *field = request_info->arena.copy(value);
+  }
+}
+
+// Reads a string property into a string field of the request info. Returns
+// false and leaves the field untouched if the property is not available.
+bool getStringValue(std::initializer_list<std::string_view> path,
+                    RequestInfo* request_info, std::string* field);
+bool getStringValue(std::initializer_list<std::string_view> path,
+                    ArenaRequestInfo* request_info, std::string_view* field);
+
 // RequestContext contains all the information available in the request.
 // Some or all part may be populated depending on need.
 struct RequestContext {
@@ -235,13 +298,42 @@ bool extractPeerMetadataFromUpstreamHostMetadata(
 // Returns flatbuffer schema for node info.
 std::string_view nodeInfoSchema();
 
+// HostBuffer owns a property value returned by the host, without copying it.
+// Values are allocated by the host with malloc, so the data is suitably
+// aligned for reading a FlatBuffer in place.
+class HostBuffer {
+ public:
+  HostBuffer() = default;
+  HostBuffer(const char* data, size_t size) : data_(data), size_(size) {}
+
+  std::string_view view() const { return {data_.get(), size_}; }
+  const uint8_t* data() const {
+    return reinterpret_cast<const uint8_t*>(data_.get());
+  }
+  size_t size() const { return size_; }
+
+ private:
+  struct Free {
+    void operator()(const char* data) const {
+      ::free(const_cast<char*>(data));
+    }
+  };
+  std::unique_ptr<const char, Free> data_;
+  size_t size_ = 0;
+};
+
+// PeerNodeInfo reads the peer metadata from filter state. The FlatBuffer is
+// borrowed from the host buffer instead of being copied. Once found, the peer
+// cannot change for the rest of the stream, so callers reporting a stream
+// multiple times may keep the instance and only re-resolve while found() is
+// false.
 class PeerNodeInfo {
  public:
   explicit PeerNodeInfo(const std::string_view peer_metadata_id_key,
                         const std::string_view peer_metadata_key);
   PeerNodeInfo() = delete;
   const ::Wasm::Common::FlatNode& get() const;
-  const std::string& id() const { return peer_id_; }
+  std::string_view id() const { return peer_id_.view(); }
 
   // Found indicates whether both ID and metadata is available.
   bool found() const { return found_; }
@@ -249,45 +341,56 @@ class PeerNodeInfo {
   // Maybe waiting indicates that the metadata is not found but may arrive
   // later.
   bool maybeWaiting() const {
-    return !found_ && peer_id_ != ::Wasm::Common::kMetadataNotFoundValue;
+    return !found_ && id() != ::Wasm::Common::kMetadataNotFoundValue;
   }
 
  private:
   bool found_;
-  std::string peer_id_;
-  std::string peer_node_;
+  HostBuffer peer_id_;
+  HostBuffer peer_node_;
   flatbuffers::DetachedBuffer fallback_peer_node_;
 };
 
 // Populate shared information between all protocols.
 // Requires that the connections are established both downstrean and upstream.
 // Caches computation using is_populated field.
+template <typename Info>
 void populateRequestInfo(bool outbound, bool use_host_header_fallback,
-                         RequestInfo* request_info);
+                         Info* request_info);
 
 // populateHTTPRequestInfo populates the RequestInfo struct. It needs access to
-// the request context.
+// the request context. Optional fields are populated if they are in the mask of
+// RequestField values.
+template <typename Info>
 void populateHTTPRequestInfo(bool outbound, bool use_host_header,
-                             RequestInfo* request_info);
+                             Info* request_info,
+                             uint32_t fields = kAllRequestFields);
 
 // populateExtendedHTTPRequestInfo populates the extra fields in RequestInfo
 // struct, includes trace headers, request id headers, and url.
-void populateExtendedHTTPRequestInfo(RequestInfo* request_info);
+template <typename Info>
+void populateExtendedHTTPRequestInfo(Info* request_info);
 
 // populateExtendedRequestInfo populates the extra fields in RequestInfo
 // source address, destination address.
-void populateExtendedRequestInfo(RequestInfo* request_info);
+template <typename Info>
+void populateExtendedRequestInfo(Info* request_info);
 
 // populateTCPRequestInfo populates the RequestInfo struct. It needs access to
-// the request context.
-void populateTCPRequestInfo(bool outbound, RequestInfo* request_info);
+// the request context. Optional fields are populated if they are in the mask of
+// RequestField values.
+template <typename Info>
+void populateTCPRequestInfo(bool outbound, Info* request_info,
+                            uint32_t fields = kAllRequestFields);
 
 // Detect HTTP and gRPC request protocols.
-void populateRequestProtocol(RequestInfo* request_info);
+template <typename Info>
+void populateRequestProtocol(Info* request_info);
 
 // populateGRPCInfo fills gRPC-related information, such as message counts.
 // Returns true if all information is filled.
-bool populateGRPCInfo(RequestInfo* request_info);
+template <typename Info>
+bool populateGRPCInfo(Info* request_info);
 
 // Read value of 'access_log_hint' key from envoy dynamic metadata which
 // determines whether to audit a request or not.
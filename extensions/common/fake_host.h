@@ -0,0 +1,291 @@
+/* Copyright 2020 Istio Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "common/stats/isolated_store_impl.h"
+#include "envoy/server/lifecycle_notifier.h"
+#include "extensions/common/node_info_generated.h"
+#include "extensions/common/wasm/wasm.h"
+#include "include/proxy-wasm/null_plugin.h"
+#include "include/proxy-wasm/null_vm.h"
+#include "test/mocks/local_info/mocks.h"
+#include "test/mocks/server/mocks.h"
+#include "test/mocks/thread_local/mocks.h"
+#include "test/mocks/upstream/mocks.h"
+#include "test/test_common/utility.h"
+
+// Stand-in host for running the extensions in the null VM. It serves canned
+// properties and headers, keeps the filter state set by the plugins, and
+// captures the metric records by metric name instead of reporting them, so
+// that several plugins can share one stream.
+
+namespace Envoy {
+namespace Extensions {
+namespace Testing {
+
+using Envoy::Extensions::Common::Wasm::Context;
+using Envoy::Extensions::Common::Wasm::PluginHandleSharedPtr;
+using Envoy::Extensions::Common::Wasm::PluginSharedPtr;
+using Envoy::Extensions::Common::Wasm::Wasm;
+using Envoy::Extensions::Common::Wasm::WasmHandleSharedPtr;
+using proxy_wasm::WasmHeaderMapType;
+using proxy_wasm::WasmResult;
+
+// Joins property path segments the way the SDK serializes them.
+inline std::string propertyPath(
+    std::initializer_list<std::string_view> parts) {
+  return absl::StrJoin(parts, std::string_view("\0", 1));
+}
+
+// Returns a serialized FlatNode of the i-th peer workload.
+inline std::string peerFlatNode(size_t i) {
+  flatbuffers::FlatBufferBuilder fbb;
+  auto workload_name = fbb.CreateString(absl::StrCat("peer-workload-", i));
+  auto namespace_ = fbb.CreateString("peer-namespace");
+  std::vector<flatbuffers::Offset<::Wasm::Common::KeyVal>> labels;
+  labels.push_back(::Wasm::Common::CreateKeyVal(
+      fbb, fbb.CreateString("app"), fbb.CreateString("peer-app")));
+  labels.push_back(::Wasm::Common::CreateKeyVal(
+      fbb, fbb.CreateString("version"), fbb.CreateString("v1")));
+  auto labels_offset = fbb.CreateVectorOfSortedTables(&labels);
+  ::Wasm::Common::FlatNodeBuilder node(fbb);
+  node.add_workload_name(workload_name);
+  node.add_namespace_(namespace_);
+  node.add_labels(labels_offset);
+  fbb.Finish(node.Finish());
+  return std::string(reinterpret_cast<const char*>(fbb.GetBufferPointer()),
+                     fbb.GetSize());
+}
+
+// FakeHost holds the property and header values for the current request.
+struct FakeHost {
+  using HeaderMap = absl::flat_hash_map<std::string, std::string>;
+
+  absl::flat_hash_map<std::string, std::string> properties;
+  HeaderMap request_headers;
+  HeaderMap response_headers;
+  uint64_t records = 0;
+  // Benchmarks only count the records, which keeps the host allocation free.
+  bool capture_metrics = true;
+  // Names of the metrics defined by the plugins, by VM and metric ID.
+  absl::flat_hash_map<std::pair<const void*, uint32_t>, std::string>
+      metric_names;
+  // Recorded values in order, with the full name of their metric.
+  std::vector<std::pair<std::string, uint64_t>> metric_records;
+
+  void setProperty(std::initializer_list<std::string_view> parts,
+                   std::string_view value) {
+    properties[propertyPath(parts)] = std::string(value);
+  }
+
+  void setProperty(std::initializer_list<std::string_view> parts,
+                   int64_t value) {
+    properties[propertyPath(parts)] =
+        std::string(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  HeaderMap* headers(WasmHeaderMapType type) {
+    switch (type) {
+      case WasmHeaderMapType::RequestHeaders:
+        return &request_headers;
+      case WasmHeaderMapType::ResponseHeaders:
+        return &response_headers;
+      default:
+        return nullptr;
+    }
+  }
+};
+
+// Overrides the host calls made by the plugins during a stream.
+template <class Base>
+class FakeHostContext : public Base {
+ public:
+  template <class... Args>
+  FakeHostContext(FakeHost& host, Args&&... args)
+      : Base(std::forward<Args>(args)...), host_(host) {}
+
+  WasmResult getProperty(std::string_view path, std::string* result) override {
+    auto it = host_.properties.find(path);
+    if (it == host_.properties.end()) {
+      return Base::getProperty(path, result);
+    }
+    *result = it->second;
+    return WasmResult::Ok;
+  }
+
+  // Filter state is read back by the same path it is set with.
+  WasmResult setProperty(std::string_view path,
+                         std::string_view value) override {
+    host_.properties[path] = std::string(value);
+    return WasmResult::Ok;
+  }
+
+  WasmResult getHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                               std::string_view* value) override {
+    auto* headers = host_.headers(type);
+    if (headers != nullptr) {
+      auto it = headers->find(key);
+      if (it != headers->end()) {
+        *value = it->second;
+        return WasmResult::Ok;
+      }
+    }
+    *value = {};
+    return WasmResult::NotFound;
+  }
+
+  WasmResult addHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                               std::string_view value) override {
+    return replaceHeaderMapValue(type, key, value);
+  }
+
+  WasmResult replaceHeaderMapValue(WasmHeaderMapType type,
+                                   std::string_view key,
+                                   std::string_view value) override {
+    auto* headers = host_.headers(type);
+    if (headers == nullptr) {
+      return WasmResult::BadArgument;
+    }
+    (*headers)[key] = std::string(value);
+    return WasmResult::Ok;
+  }
+
+  WasmResult removeHeaderMapValue(WasmHeaderMapType type,
+                                  std::string_view key) override {
+    auto* headers = host_.headers(type);
+    if (headers == nullptr) {
+      return WasmResult::BadArgument;
+    }
+    headers->erase(key);
+    return WasmResult::Ok;
+  }
+
+  // Metrics are still defined by the host, which assigns their IDs.
+  WasmResult defineMetric(uint32_t type, std::string_view name,
+                          uint32_t* metric_id_ptr) override {
+    auto result = Base::defineMetric(type, name, metric_id_ptr);
+    if (result == WasmResult::Ok && host_.capture_metrics) {
+      host_.metric_names[metricKey(*metric_id_ptr)] = std::string(name);
+    }
+    return result;
+  }
+
+  WasmResult recordMetric(uint32_t metric_id, uint64_t value) override {
+    host_.records++;
+    if (!host_.capture_metrics) {
+      return WasmResult::Ok;
+    }
+    auto it = host_.metric_names.find(metricKey(metric_id));
+    if (it != host_.metric_names.end()) {
+      host_.metric_records.emplace_back(it->second, value);
+    }
+    return WasmResult::Ok;
+  }
+
+ private:
+  // Metric IDs are only unique within a VM.
+  std::pair<const void*, uint32_t> metricKey(uint32_t metric_id) const {
+    return {this->wasm(), metric_id};
+  }
+
+  FakeHost& host_;
+};
+
+// NullVmPlugin loads a registered null VM plugin against a fake host. The
+// host properties read at configuration, e.g. the node metadata, are set
+// before the plugin is loaded.
+class NullVmPlugin {
+ public:
+  NullVmPlugin(FakeHost& host, std::string_view code,
+               std::string_view root_id, std::string_view configuration,
+               envoy::config::core::v3::TrafficDirection direction)
+      : host_(host) {
+    envoy::extensions::wasm::v3::VmConfig vm_config;
+    vm_config.set_vm_id(std::string(code));
+    vm_config.set_runtime("envoy.wasm.runtime.null");
+    vm_config.mutable_code()->mutable_local()->set_inline_bytes(
+        std::string(code));
+    api_ = Api::createApiForTest(stats_store_);
+    scope_ = Envoy::Stats::ScopeSharedPtr(stats_store_.createScope("wasm."));
+    plugin_ = std::make_shared<Extensions::Common::Wasm::Plugin>(
+        std::string(root_id), std::string(root_id), "",
+        "envoy.wasm.runtime.null", std::string(configuration), false,
+        direction, local_info_, &listener_metadata_);
+    auto create_context = [this](Wasm* wasm, const PluginSharedPtr& plugin) {
+      return new FakeHostContext<Context>(host_, wasm, plugin);
+    };
+    Extensions::Common::Wasm::createWasm(
+        vm_config, cr_config_, plugin_, scope_, cluster_manager_,
+        init_manager_, dispatcher_, *api_, lifecycle_notifier_,
+        remote_data_provider_,
+        [this](WasmHandleSharedPtr wasm) { wasm_ = wasm; }, create_context);
+    plugin_handle_ = Extensions::Common::Wasm::getOrCreateThreadLocalPlugin(
+        wasm_, plugin_, dispatcher_, create_context);
+    wasm_ = plugin_handle_->wasmHandleForTest();
+    root_context_id_ = wasm_->wasm()->getRootContext(plugin_, false)->id();
+  }
+
+  std::unique_ptr<Context> newStream() {
+    auto context = std::make_unique<FakeHostContext<Context>>(
+        host_, wasm_->wasm().get(), root_context_id_, plugin_);
+    context->onCreate();
+    return context;
+  }
+
+  // Runs the timer callback of the plugin root context.
+  void tick() { wasm_->wasm()->tickHandler(root_context_id_); }
+
+  // Returns the plugin side of the root context, to inspect its state.
+  template <class T>
+  T* rootContext() {
+    auto* vm = static_cast<proxy_wasm::NullVm*>(wasm_->wasm()->wasm_vm());
+    auto* plugin =
+        static_cast<proxy_wasm::null_plugin::NullPlugin*>(vm->plugin_.get());
+    return dynamic_cast<T*>(plugin->getRootContext(root_context_id_));
+  }
+
+ private:
+  FakeHost& host_;
+  Envoy::Stats::IsolatedStoreImpl stats_store_;
+  Envoy::Stats::ScopeSharedPtr scope_;
+  Api::ApiPtr api_;
+  testing::NiceMock<Event::MockDispatcher> dispatcher_;
+  testing::NiceMock<Upstream::MockClusterManager> cluster_manager_;
+  testing::NiceMock<Init::MockManager> init_manager_;
+  testing::NiceMock<LocalInfo::MockLocalInfo> local_info_;
+  testing::NiceMock<Server::MockServerLifecycleNotifier> lifecycle_notifier_;
+  envoy::config::core::v3::Metadata listener_metadata_;
+  envoy::extensions::wasm::v3::CapabilityRestrictionConfig cr_config_;
+  Config::DataSource::RemoteAsyncDataProviderPtr remote_data_provider_;
+  WasmHandleSharedPtr wasm_;
+  PluginSharedPtr plugin_;
+  PluginHandleSharedPtr plugin_handle_;
+  uint32_t root_context_id_ = 0;
+};
+
+}  // namespace Testing
+}  // namespace Extensions
+}  // namespace Envoy
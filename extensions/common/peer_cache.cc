@@ -0,0 +1,143 @@
+/* Copyright 2020 Istio Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extensions/common/peer_cache.h"
+
+namespace Wasm {
+namespace Common {
+
+size_t PeerCache::insert(std::string&& id, PeerNodePtr node, uint64_t now) {
+  size_t entry_bytes = sizeof(Entry) + sizeof(std::string) + id.size() +
+                       sizeof(std::string) + node->size() +
+                       4 * sizeof(void*) /* list and bucket nodes */;
+  auto result = entries_.try_emplace(std::move(id));
+  if (!result.second) {
+    return 0;
+  }
+  auto& entry = result.first->second;
+  entry.node = std::move(node);
+  entry.bytes = entry_bytes;
+  entry.used = now;
+  entry.lru = lru_.insert(lru_.begin(), &result.first->first);
+  bytes_ += entry_bytes;
+
+  size_t evicted = 0;
+  while (entries_.size() > 1 &&
+         ((max_entries_ > 0 && entries_.size() > max_entries_) ||
+          (max_bytes_ > 0 && bytes_ > max_bytes_))) {
+    evict();
+    evicted++;
+  }
+  return evicted;
+}
+
+size_t PeerCache::evict() {
+  if (lru_.empty()) {
+    return 0;
+  }
+  auto it = entries_.find(*lru_.back());
+  const size_t entry_bytes = it->second.bytes;
+  bytes_ -= entry_bytes;
+  lru_.pop_back();
+  entries_.erase(it);
+  return entry_bytes;
+}
+
+SharedPeerCache& SharedPeerCache::get() {
+  // Never destroyed, since workers may still be running at exit.
+  static SharedPeerCache* const cache = new SharedPeerCache();
+  return *cache;
+}
+
+void SharedPeerCache::setLimits(size_t max_entries, size_t max_bytes) {
+  max_entries_ = max_entries;
+  max_bytes_ = max_bytes;
+}
+
+PeerNodePtr SharedPeerCache::find(const std::string& id) {
+  auto& s = shard(id);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  return s.cache.find(id, clock_++);
+}
+
+size_t SharedPeerCache::insert(std::string&& id, PeerNodePtr node) {
+  {
+    auto& s = shard(id);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    // Shards are unlimited, so the insertion only adds to the totals.
+    const size_t size = s.cache.size();
+    const size_t bytes = s.cache.bytes();
+    s.cache.insert(std::move(id), std::move(node), clock_++);
+    size_ += s.cache.size() - size;
+    bytes_ += s.cache.bytes() - bytes;
+  }
+  // The new peer is the most recently used, and is never evicted unless other
+  // threads evict the rest of the cache meanwhile.
+  size_t evicted = 0;
+  while (size_ > 1 && overLimits() && evictOldest()) {
+    evicted++;
+  }
+  return evicted;
+}
+
+bool SharedPeerCache::evictOldest() {
+  // Each shard keeps its peers in recency order, so the least recently used
+  // peer of the cache is the oldest of the shard tails. The tails may be used
+  // by other threads between the scan and the eviction, which makes the order
+  // approximate under contention.
+  Shard* oldest_shard = nullptr;
+  uint64_t oldest = 0;
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto used = shard.cache.oldest();
+    if (used.has_value() && (oldest_shard == nullptr || *used < oldest)) {
+      oldest_shard = &shard;
+      oldest = *used;
+    }
+  }
+  if (oldest_shard == nullptr) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(oldest_shard->mutex);
+  const size_t entry_bytes = oldest_shard->cache.evict();
+  if (entry_bytes == 0) {
+    // Emptied by another thread meanwhile.
+    return false;
+  }
+  size_--;
+  bytes_ -= entry_bytes;
+  return true;
+}
+
+size_t SharedPeerCache::size() {
+  size_t size = 0;
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    size += shard.cache.size();
+  }
+  return size;
+}
+
+void SharedPeerCache::clear() {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    size_ -= shard.cache.size();
+    bytes_ -= shard.cache.bytes();
+    shard.cache.clear();
+  }
+}
+
+}  // namespace Common
+}  // namespace Wasm
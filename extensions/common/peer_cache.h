@@ -0,0 +1,160 @@
+/* Copyright 2020 Istio Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace Wasm {
+namespace Common {
+
+// Default number of peers kept by a peer cache.
+constexpr size_t kDefaultPeerCacheMaxSize = 500;
+
+// Decoded peer node flat buffer, shared by the cache and its readers.
+using PeerNodePtr = std::shared_ptr<const std::string>;
+
+// PeerCache maps peer IDs to the decoded peer flat buffers. Least recently
+// used peers are evicted beyond the entry or the byte limit, where zero means
+// unlimited. Not thread-safe.
+class PeerCache {
+ public:
+  void setLimits(size_t max_entries, size_t max_bytes) {
+    max_entries_ = max_entries;
+    max_bytes_ = max_bytes;
+  }
+
+  // Returns the peer flat buffer and marks the peer as most recently used, or
+  // nullptr if the peer is absent. The use is stamped with `now`, which is
+  // only read back by oldest().
+  PeerNodePtr find(const std::string& id, uint64_t now = 0) {
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+      return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    it->second.used = now;
+    return it->second.node;
+  }
+
+  // Inserts a peer and returns the number of peers evicted to stay within the
+  // limits. The new peer is never evicted.
+  size_t insert(std::string&& id, PeerNodePtr node, uint64_t now = 0);
+
+  // Evicts the least recently used peer. Returns the bytes it used, or zero if
+  // the cache is empty.
+  size_t evict();
+
+  // Returns the use stamp of the least recently used peer, or nothing if the
+  // cache is empty.
+  std::optional<uint64_t> oldest() const {
+    if (lru_.empty()) {
+      return {};
+    }
+    return entries_.find(*lru_.back())->second.used;
+  }
+
+  void clear() {
+    entries_.clear();
+    lru_.clear();
+    bytes_ = 0;
+  }
+
+  size_t size() const { return entries_.size(); }
+  // Approximate memory used by the cache entries.
+  size_t bytes() const { return bytes_; }
+
+ private:
+  struct Entry {
+    PeerNodePtr node;
+    size_t bytes;
+    uint64_t used;
+    // Position in the recency list, which points back at the map key.
+    std::list<const std::string*>::iterator lru;
+  };
+
+  // Node-based map so that the key addresses in lru_ stay valid.
+  std::unordered_map<std::string, Entry> entries_;
+  // Most recently used first.
+  std::list<const std::string*> lru_;
+  size_t bytes_ = 0;
+  size_t max_entries_ = 0;
+  size_t max_bytes_ = 0;
+};
+
+// SharedPeerCache is a process-wide peer cache used concurrently by the worker
+// threads, so that a peer is decoded and stored once per process rather than
+// once per worker. Peers are spread by ID over independently locked shards,
+// and the limits are enforced across the shards by evicting the least
+// recently used peer of the whole cache.
+class SharedPeerCache {
+ public:
+  // Returns the process-wide instance.
+  static SharedPeerCache& get();
+
+  // Limits are global: they are shared by all the users of the instance, and
+  // the last configured ones win.
+  void setLimits(size_t max_entries, size_t max_bytes);
+
+  PeerNodePtr find(const std::string& id);
+  size_t insert(std::string&& id, PeerNodePtr node);
+
+  size_t size();
+  void clear();
+
+ private:
+  static constexpr size_t kShards = 16;
+
+  SharedPeerCache() { setLimits(kDefaultPeerCacheMaxSize, 0); }
+
+  bool overLimits() const {
+    const size_t max_entries = max_entries_;
+    const size_t max_bytes = max_bytes_;
+    return (max_entries > 0 && size_ > max_entries) ||
+           (max_bytes > 0 && bytes_ > max_bytes);
+  }
+  // Evicts the least recently used peer of all the shards. Returns whether a
+  // peer was evicted.
+  bool evictOldest();
+
+  struct Shard {
+    std::mutex mutex;
+    PeerCache cache;
+  };
+  Shard& shard(std::string_view id) {
+    return shards_[std::hash<std::string_view>()(id) % kShards];
+  }
+
+  std::array<Shard, kShards> shards_;
+  // Stamps the peer uses, so that the shards can be compared by recency.
+  std::atomic<uint64_t> clock_{0};
+  std::atomic<size_t> max_entries_{0};
+  std::atomic<size_t> max_bytes_{0};
+  // Number of peers and their bytes in all the shards.
+  std::atomic<size_t> size_{0};
+  std::atomic<size_t> bytes_{0};
+};
+
+}  // namespace Common
+}  // namespace Wasm
@@ -0,0 +1,148 @@
+/* Copyright 2020 Istio Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extensions/common/peer_cache.h"
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace Wasm {
+namespace Common {
+namespace {
+
+PeerNodePtr node(std::string_view value) {
+  return std::make_shared<const std::string>(value);
+}
+
+TEST(PeerCacheTest, EvictsLeastRecentlyUsed) {
+  PeerCache cache;
+  cache.setLimits(/* max_entries */ 2, /* max_bytes */ 0);
+  EXPECT_EQ(0u, cache.insert("a", node("A")));
+  EXPECT_EQ(0u, cache.insert("b", node("B")));
+
+  // A lookup refreshes the peer, so the other one is evicted.
+  ASSERT_NE(nullptr, cache.find("a"));
+  EXPECT_EQ(1u, cache.insert("c", node("C")));
+  EXPECT_EQ(nullptr, cache.find("b"));
+  EXPECT_EQ("A", *cache.find("a"));
+  EXPECT_EQ(2u, cache.size());
+
+  // Existing peers are kept as they are.
+  EXPECT_EQ(0u, cache.insert("a", node("other")));
+  EXPECT_EQ("A", *cache.find("a"));
+}
+
+TEST(PeerCacheTest, EvictsBeyondByteLimit) {
+  PeerCache cache;
+  EXPECT_EQ(0u, cache.insert("a", node("A")));
+  size_t bytes = cache.bytes();
+  EXPECT_EQ(0u, cache.insert("b", node("B")));
+  EXPECT_EQ(2 * bytes, cache.bytes());
+
+  // The new peer is never evicted, even when over the limit alone.
+  cache.setLimits(0, bytes);
+  EXPECT_EQ(2u, cache.insert("c", node(std::string(100, 'x'))));
+  EXPECT_EQ(1u, cache.size());
+  ASSERT_NE(nullptr, cache.find("c"));
+
+  cache.clear();
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_EQ(0u, cache.bytes());
+}
+
+TEST(SharedPeerCacheTest, SharesPeersAcrossThreads) {
+  auto& cache = SharedPeerCache::get();
+  cache.clear();
+  cache.setLimits(kDefaultPeerCacheMaxSize, 0);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&cache]() {
+      for (int i = 0; i < 100; i++) {
+        std::string id = "peer-" + std::to_string(i);
+        if (cache.find(id) == nullptr) {
+          cache.insert(std::string(id), node(id));
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(100u, cache.size());
+  EXPECT_EQ("peer-42", *cache.find("peer-42"));
+  EXPECT_EQ(&cache, &SharedPeerCache::get());
+  cache.clear();
+}
+
+// The limits hold for the whole cache, however the peers are spread over the
+// shards, and even below one peer per shard.
+TEST(SharedPeerCacheTest, LimitsEntriesAcrossShards) {
+  auto& cache = SharedPeerCache::get();
+  cache.clear();
+  cache.setLimits(/* max_entries */ 3, /* max_bytes */ 0);
+
+  size_t evicted = 0;
+  for (int i = 0; i < 100; i++) {
+    std::string id = "peer-" + std::to_string(i);
+    evicted += cache.insert(std::string(id), node(id));
+  }
+  EXPECT_EQ(3u, cache.size());
+  EXPECT_EQ(97u, evicted);
+  for (int i = 0; i < 97; i++) {
+    EXPECT_EQ(nullptr, cache.find("peer-" + std::to_string(i)));
+  }
+  ASSERT_NE(nullptr, cache.find("peer-97"));
+
+  // The least recently used peer of the whole cache is evicted, whichever
+  // shard the new peer lands in.
+  EXPECT_EQ(1u, cache.insert("peer-100", node("peer-100")));
+  EXPECT_EQ(nullptr, cache.find("peer-98"));
+  EXPECT_NE(nullptr, cache.find("peer-97"));
+  EXPECT_NE(nullptr, cache.find("peer-99"));
+  EXPECT_NE(nullptr, cache.find("peer-100"));
+
+  cache.setLimits(kDefaultPeerCacheMaxSize, 0);
+  cache.clear();
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(SharedPeerCacheTest, LimitsBytesAcrossShards) {
+  // Peers of the same ID and value sizes use the same bytes.
+  PeerCache single;
+  single.insert("peer-0", node("peer-0"));
+  const size_t peer_bytes = single.bytes();
+
+  auto& cache = SharedPeerCache::get();
+  cache.clear();
+  cache.setLimits(0, 2 * peer_bytes);
+  for (int i = 0; i < 10; i++) {
+    std::string id = "peer-" + std::to_string(i);
+    cache.insert(std::string(id), node(id));
+  }
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_NE(nullptr, cache.find("peer-8"));
+  EXPECT_NE(nullptr, cache.find("peer-9"));
+
+  cache.setLimits(kDefaultPeerCacheMaxSize, 0);
+  cache.clear();
+}
+
+}  // namespace
+}  // namespace Common
+}  // namespace Wasm
@@ -13,6 +13,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <string>
 
 #include "extensions/common/context.h"
@@ -167,5 +168,35 @@ const std::string parseResponseFlag(uint64_t response_flag) {
   return result.empty() ? ::Wasm::Common::NONE : result;
 }
 
+char* StringArena::grow(size_t size) {
+  // Oversized values get a dedicated block so that the remainder of the
+  // current block stays available for later copies.
+  if (size > block_size_ && head_) {
+    overflow_.emplace_back(new char[size]);
+    bytes_ += size;
+    return overflow_.back().get();
+  }
+  const size_t block_size = std::max(size, block_size_);
+  std::unique_ptr<char[]> block(new char[block_size]);
+  char* dest = block.get();
+  cursor_ = dest + size;
+  available_ = block_size - size;
+  bytes_ += block_size;
+  if (!head_) {
+    head_ = std::move(block);
+    head_size_ = block_size;
+  } else {
+    overflow_.push_back(std::move(block));
+  }
+  return dest;
+}
+
+void StringArena::clear() {
+  overflow_.clear();
+  cursor_ = head_.get();
+  available_ = head_size_;
+  bytes_ = head_size_;
+}
+
 }  // namespace Common
 }  // namespace Wasm
@@ -15,7 +15,11 @@
 
 #pragma once
 
+#include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace Wasm {
 namespace Common {
@@ -23,5 +27,52 @@ namespace Common {
 // Parses an integer response flag into a readable short string.
 const std::string parseResponseFlag(uint64_t response_flag);
 
+// StringArena is a bump allocator for strings that share the lifetime of a
+// stream. Copies are appended to blocks which are never moved or resized, so
+// the returned views stay valid until clear() or the arena is destroyed.
+// Typical streams fit in the first block, which takes a single allocation.
+class StringArena {
+ public:
+  static constexpr size_t kDefaultBlockSize = 512;
+
+  explicit StringArena(size_t block_size = kDefaultBlockSize)
+      : block_size_(block_size) {}
+
+  // Copies the value into the arena and returns a view of the copy.
+  std::string_view copy(std::string_view value) {
+    if (value.empty()) {
+      return {};
+    }
+    char* dest;
+    if (value.size() > available_) {
+      dest = grow(value.size());
+    } else {
+      dest = cursor_;
+      cursor_ += value.size();
+      available_ -= value.size();
+    }
+    std::memcpy(dest, value.data(), value.size());
+    return std::string_view(dest, value.size());
+  }
+
+  // Invalidates all views. The first block is retained for reuse.
+  void clear();
+
+  // Total bytes allocated by the arena.
+  size_t bytes() const { return bytes_; }
+
+ private:
+  // Allocates a new block and reserves the given number of bytes from it.
+  char* grow(size_t size);
+
+  const size_t block_size_;
+  std::unique_ptr<char[]> head_;
+  size_t head_size_ = 0;
+  std::vector<std::unique_ptr<char[]>> overflow_;
+  char* cursor_ = nullptr;
+  size_t available_ = 0;
+  size_t bytes_ = 0;
+};
+
 }  // namespace Common
 }  // namespace Wasm
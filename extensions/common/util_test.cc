@@ -51,6 +51,36 @@ TEST(WasmCommonUtilsTest, ParseResponseFlag) {
   { EXPECT_EQ("DPE,786432", parseResponseFlag(0xC0000)); }
 }
 
+TEST(WasmCommonUtilsTest, StringArena) {
+  StringArena arena(16);
+  std::string source = "destination";
+  auto first = arena.copy(source);
+  source = "overwritten";
+  EXPECT_EQ("destination", first);
+  EXPECT_EQ(16u, arena.bytes());
+
+  // Values larger than a block get a dedicated block, and the current block
+  // is still used for small values.
+  auto large = arena.copy("cluster.local.svc.default");
+  auto small = arena.copy("abc");
+  EXPECT_EQ("cluster.local.svc.default", large);
+  EXPECT_EQ("abc", small);
+  EXPECT_EQ(first.data() + first.size(), small.data());
+  EXPECT_EQ(16u + 25u, arena.bytes());
+
+  // Views stay valid across new blocks.
+  auto next = arena.copy("another value");
+  EXPECT_EQ("another value", next);
+  EXPECT_EQ("destination", first);
+  EXPECT_EQ(32u + 25u, arena.bytes());
+
+  EXPECT_TRUE(arena.copy("").empty());
+
+  arena.clear();
+  EXPECT_EQ(16u, arena.bytes());
+  EXPECT_EQ(first.data(), arena.copy("reused").data());
+}
+
 }  // namespace
 }  // namespace Common
 }  // namespace Wasm
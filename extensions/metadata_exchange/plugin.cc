@@ -15,7 +15,11 @@
 
 #include "extensions/metadata_exchange/plugin.h"
 
+#include <algorithm>
+
+#include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
 #include "extensions/common/context.h"
 #include "extensions/common/proto_util.h"
@@ -45,6 +49,40 @@ using Base64 = Envoy::Base64;
 static RegisterContextFactory register_MetadataExchange(
     CONTEXT_FACTORY(PluginContext), ROOT_FACTORY(PluginRootContext));
 
+std::vector<std::string>* UpstreamPeers::find(const std::string& authority) {
+  auto it = entries_.find(authority);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  return &it->second.peer_ids;
+}
+
+void UpstreamPeers::add(const std::string& authority,
+                        std::string_view peer_id) {
+  auto* peer_ids = find(authority);
+  if (peer_ids == nullptr) {
+    if (max_authorities_ == 0) {
+      return;
+    }
+    if (entries_.size() >= max_authorities_) {
+      entries_.erase(*lru_.back());
+      lru_.pop_back();
+    }
+    auto result = entries_.try_emplace(authority);
+    result.first->second.lru = lru_.insert(lru_.begin(), &result.first->first);
+    peer_ids = &result.first->second.peer_ids;
+  }
+  auto it = std::find(peer_ids->begin(), peer_ids->end(), peer_id);
+  if (it == peer_ids->end()) {
+    if (peer_ids->size() >= MaxKnownUpstreamPeers) {
+      peer_ids->pop_back();
+    }
+    it = peer_ids->emplace(peer_ids->end(), peer_id);
+  }
+  std::rotate(peer_ids->begin(), it, it + 1);
+}
+
 void PluginRootContext::updateMetadataValue() {
   auto node_info = ::Wasm::Common::extractLocalNodeFlatBuffer();
 
@@ -57,6 +95,10 @@ void PluginRootContext::updateMetadataValue() {
   ::Wasm::Common::serializeToStringDeterministic(metadata, &metadata_bytes);
   metadata_value_ =
       Base64::encode(metadata_bytes.data(), metadata_bytes.size());
+  compact_metadata_value_ = absl::StrCat(
+      CompactMetadataPrefix,
+      Base64::encode(reinterpret_cast<const char*>(node_info.data()),
+                     node_info.size()));
 }
 
 // Metadata exchange has sane defaults and therefore it will be fully
@@ -74,6 +116,9 @@ bool PluginRootContext::onConfigure(size_t size) {
   if (size > 0 && !configure(size)) {
     LOG_WARN("configuration has errrors, but initialzation can continue.");
   }
+  cache_.setLimits(std::max<int64_t>(max_peer_cache_size_, 0),
+                   std::max<int64_t>(max_peer_cache_bytes_, 0));
+  upstream_peers_.setMaxAuthorities(std::max<int64_t>(max_peer_cache_size_, 0));
 
   // Declare filter state property type.
   const std::string function = "declare_property";
@@ -115,39 +160,125 @@ bool PluginRootContext::configure(size_t configuration_size) {
       Wasm::Common::JsonParserResultDetail::OK) {
     max_peer_cache_size_ = max_peer_cache_size_field.value();
   }
+  auto max_peer_cache_bytes_field =
+      ::Wasm::Common::JsonGetField<int64_t>(j, "max_peer_cache_bytes");
+  if (max_peer_cache_bytes_field.detail() ==
+      Wasm::Common::JsonParserResultDetail::OK) {
+    max_peer_cache_bytes_ = max_peer_cache_bytes_field.value();
+  }
+  auto compact_metadata_field =
+      ::Wasm::Common::JsonGetField<bool>(j, "compact_metadata");
+  if (compact_metadata_field.detail() ==
+      Wasm::Common::JsonParserResultDetail::OK) {
+    compact_metadata_ = compact_metadata_field.value();
+  }
+  auto id_only_metadata_field =
+      ::Wasm::Common::JsonGetField<bool>(j, "id_only_metadata");
+  if (id_only_metadata_field.detail() ==
+      Wasm::Common::JsonParserResultDetail::OK) {
+    id_only_metadata_ = id_only_metadata_field.value();
+  }
+
+  std::vector<std::string_view> formats;
+  if (compact_metadata_) {
+    formats.push_back(CompactMetadataFormat);
+  }
+  accept_value_ = absl::StrJoin(formats, ",");
   return true;
 }
 
-bool PluginRootContext::updatePeer(std::string_view key,
-                                   std::string_view peer_id,
-                                   std::string_view peer_header) {
-  std::string id = std::string(peer_id);
+bool PluginRootContext::resolvePeer(std::string_view key,
+                                    std::string_view peer_id) {
+  if (max_peer_cache_size_ <= 0) {
+    return false;
+  }
+  auto node = cache_.find(std::string(peer_id));
+  if (node == nullptr) {
+    incrementMetric(cache_misses_, 1);
+    return false;
+  }
+  setFilterState(key, *node);
+  cache_hits_accumulator_++;
+  if (cache_hits_accumulator_ == 100) {
+    incrementMetric(cache_hits_, cache_hits_accumulator_);
+    cache_hits_accumulator_ = 0;
+  }
+  return true;
+}
+
+void PluginRootContext::restorePeer(std::string_view key,
+                                    const KnownPeer& peer) {
+  setFilterState(key, *peer.second);
   if (max_peer_cache_size_ > 0) {
-    auto it = cache_.find(id);
-    if (it != cache_.end()) {
-      setFilterState(key, it->second);
-      return true;
+    size_t evicted = cache_.insert(std::string(peer.first), peer.second);
+    if (evicted > 0) {
+      incrementMetric(cache_evictions_, evicted);
     }
   }
+}
 
-  auto bytes = Base64::decodeWithoutPadding(peer_header);
-  google::protobuf::Struct metadata;
-  if (!metadata.ParseFromString(bytes)) {
-    return false;
+std::vector<KnownPeer> PluginRootContext::knownUpstreamPeers(
+    const std::string& authority) {
+  std::vector<KnownPeer> peers;
+  auto* peer_ids = upstream_peers_.find(authority);
+  if (peer_ids == nullptr) {
+    return peers;
+  }
+  // Peers evicted from the cache are forgotten, so that they reply with the
+  // full metadata again.
+  auto it = peer_ids->begin();
+  while (it != peer_ids->end()) {
+    auto node = cache_.find(*it);
+    if (node == nullptr) {
+      it = peer_ids->erase(it);
+      continue;
+    }
+    peers.emplace_back(*it, std::move(node));
+    ++it;
   }
+  return peers;
+}
 
-  auto fb = ::Wasm::Common::extractNodeFlatBufferFromStruct(metadata);
-  std::string_view out(reinterpret_cast<const char*>(fb.data()), fb.size());
+bool PluginRootContext::updatePeer(std::string_view key,
+                                   std::string_view peer_id,
+                                   std::string_view peer_header) {
+  std::string id = std::string(peer_id);
+
+  std::string compact_bytes;
+  flatbuffers::DetachedBuffer fb;
+  std::string_view out;
+  if (absl::StartsWith(peer_header, CompactMetadataPrefix)) {
+    // Compact metadata is the peer flat buffer itself, which only needs to be
+    // verified.
+    compact_bytes = Base64::decodeWithoutPadding(
+        peer_header.substr(CompactMetadataPrefix.size()));
+    flatbuffers::Verifier verifier(
+        reinterpret_cast<const uint8_t*>(compact_bytes.data()),
+        compact_bytes.size());
+    if (!::Wasm::Common::VerifyFlatNodeBuffer(verifier)) {
+      return false;
+    }
+    out = compact_bytes;
+  } else {
+    auto bytes = Base64::decodeWithoutPadding(peer_header);
+    google::protobuf::Struct metadata;
+    if (!metadata.ParseFromString(bytes)) {
+      return false;
+    }
+    fb = ::Wasm::Common::extractNodeFlatBufferFromStruct(metadata);
+    out = std::string_view(reinterpret_cast<const char*>(fb.data()),
+                           fb.size());
+  }
   setFilterState(key, out);
 
   if (max_peer_cache_size_ > 0) {
-    // do not let the cache grow beyond max cache size.
-    if (static_cast<uint32_t>(cache_.size()) > max_peer_cache_size_) {
-      auto it = cache_.begin();
-      cache_.erase(cache_.begin(), std::next(it, max_peer_cache_size_ / 4));
-      LOG_DEBUG(absl::StrCat("cleaned cache, new cache_size:", cache_.size()));
+    size_t evicted =
+        cache_.insert(std::move(id), std::make_shared<const std::string>(out));
+    if (evicted > 0) {
+      incrementMetric(cache_evictions_, evicted);
+      LOG_DEBUG(absl::StrCat("evicted ", evicted,
+                             " peers, new cache_size:", cache_.size()));
     }
-    cache_.emplace(std::move(id), out);
   }
 
   return true;
@@ -159,38 +290,122 @@ FilterHeadersStatus PluginContext::onRequestHeaders(uint32_t, bool) {
   if (downstream_metadata_id != nullptr &&
       !downstream_metadata_id->view().empty()) {
     removeRequestHeader(ExchangeMetadataHeaderId);
-    setFilterState(::Wasm::Common::kDownstreamMetadataIdKey,
-                   downstream_metadata_id->view());
   } else {
     metadata_id_received_ = false;
   }
 
+  bool peer_resolved = false;
   auto downstream_metadata_value = getRequestHeader(ExchangeMetadataHeader);
   if (downstream_metadata_value != nullptr &&
       !downstream_metadata_value->view().empty()) {
     removeRequestHeader(ExchangeMetadataHeader);
-    if (!rootContext()->updatePeer(::Wasm::Common::kDownstreamMetadataKey,
-                                   downstream_metadata_id->view(),
-                                   downstream_metadata_value->view())) {
+    peer_resolved =
+        rootContext()->resolvePeer(::Wasm::Common::kDownstreamMetadataKey,
+                                   downstream_metadata_id->view()) ||
+        rootContext()->updatePeer(::Wasm::Common::kDownstreamMetadataKey,
+                                  downstream_metadata_id->view(),
+                                  downstream_metadata_value->view());
+    if (!peer_resolved) {
       LOG_DEBUG("cannot set downstream peer node");
     }
+  } else if (metadata_id_received_) {
+    // the peer expects its metadata to be cached from an earlier exchange
+    peer_resolved = rootContext()->resolvePeer(
+        ::Wasm::Common::kDownstreamMetadataKey, downstream_metadata_id->view());
+    if (!peer_resolved) {
+      LOG_DEBUG("cannot resolve downstream peer node");
+      peer_metadata_missing_ = true;
+    }
   } else {
     metadata_received_ = false;
   }
 
+  // The ID is only set along with the peer metadata, and is otherwise marked
+  // as not found for the telemetry filters.
+  if (metadata_id_received_) {
+    setFilterState(::Wasm::Common::kDownstreamMetadataIdKey,
+                   peer_resolved ? downstream_metadata_id->view()
+                                 : ::Wasm::Common::kMetadataNotFoundValue);
+  }
+
+  auto downstream_metadata_accept =
+      getRequestHeader(ExchangeMetadataHeaderAccept);
+  if (downstream_metadata_accept != nullptr &&
+      !downstream_metadata_accept->view().empty()) {
+    removeRequestHeader(ExchangeMetadataHeaderAccept);
+    for (auto format :
+         absl::StrSplit(downstream_metadata_accept->view(), ',')) {
+      if (format == CompactMetadataFormat) {
+        compact_metadata_accepted_ = true;
+      }
+    }
+  }
+
+  auto downstream_metadata_known =
+      getRequestHeader(ExchangeMetadataHeaderKnown);
+  if (downstream_metadata_known != nullptr &&
+      !downstream_metadata_known->view().empty()) {
+    removeRequestHeader(ExchangeMetadataHeaderKnown);
+    auto nodeid = nodeId();
+    for (auto known_id :
+         absl::StrSplit(downstream_metadata_known->view(), ',')) {
+      if (!nodeid.empty() && known_id == nodeid) {
+        local_metadata_known_ = true;
+      }
+    }
+  }
+
+  auto downstream_metadata_resend =
+      getRequestHeader(ExchangeMetadataHeaderResend);
+  if (downstream_metadata_resend != nullptr &&
+      !downstream_metadata_resend->view().empty()) {
+    removeRequestHeader(ExchangeMetadataHeaderResend);
+    resend_requested_ = true;
+  }
+
   // do not send request internal headers to sidecar app if it is an inbound
   // proxy
   if (direction_ != ::Wasm::Common::TrafficDirection::Inbound) {
     auto metadata = metadataValue();
-    // insert peer metadata struct for upstream
+    auto nodeid = nodeId();
+    // insert peer metadata struct for upstream. The upstream peer is not
+    // known yet, so requests always carry the full metadata.
     if (!metadata.empty()) {
       replaceRequestHeader(ExchangeMetadataHeader, metadata);
     }
 
-    auto nodeid = nodeId();
     if (!nodeid.empty()) {
       replaceRequestHeader(ExchangeMetadataHeaderId, nodeid);
     }
+
+    // The upstream peer is not known yet, so requests keep the format that
+    // every peer understands and only advertise the compact one.
+    auto accept = rootContext()->acceptValue();
+    if (!accept.empty()) {
+      replaceRequestHeader(ExchangeMetadataHeaderAccept, accept);
+    }
+
+    // List the upstream peers that may receive the request and whose metadata
+    // is held by the stream until the reply.
+    if (rootContext()->idOnlyMetadata()) {
+      auto authority = getRequestHeader(":authority");
+      if (authority != nullptr && !authority->view().empty()) {
+        authority_ = std::string(authority->view());
+        known_upstream_peers_ = rootContext()->knownUpstreamPeers(authority_);
+      }
+      if (!known_upstream_peers_.empty()) {
+        std::vector<std::string_view> known_ids;
+        for (const auto& peer : known_upstream_peers_) {
+          known_ids.push_back(peer.first);
+        }
+        replaceRequestHeader(ExchangeMetadataHeaderKnown,
+                             absl::StrJoin(known_ids, ","));
+      }
+    }
+
+    if (rootContext()->takeResendRequest()) {
+      replaceRequestHeader(ExchangeMetadataHeaderResend, "1");
+    }
   }
 
   return FilterHeadersStatus::Continue;
@@ -199,42 +414,99 @@ FilterHeadersStatus PluginContext::onRequestHeaders(uint32_t, bool) {
 FilterHeadersStatus PluginContext::onResponseHeaders(uint32_t, bool) {
   // strip and store upstream peer metadata
   auto upstream_metadata_id = getResponseHeader(ExchangeMetadataHeaderId);
-  if (upstream_metadata_id != nullptr &&
-      !upstream_metadata_id->view().empty()) {
+  bool upstream_metadata_id_received = upstream_metadata_id != nullptr &&
+                                       !upstream_metadata_id->view().empty();
+  if (upstream_metadata_id_received) {
     removeResponseHeader(ExchangeMetadataHeaderId);
-    setFilterState(::Wasm::Common::kUpstreamMetadataIdKey,
-                   upstream_metadata_id->view());
   }
 
+  bool peer_resolved = false;
   auto upstream_metadata_value = getResponseHeader(ExchangeMetadataHeader);
   if (upstream_metadata_value != nullptr &&
       !upstream_metadata_value->view().empty()) {
     removeResponseHeader(ExchangeMetadataHeader);
-    if (!rootContext()->updatePeer(::Wasm::Common::kUpstreamMetadataKey,
-                                   upstream_metadata_id->view(),
-                                   upstream_metadata_value->view())) {
+    peer_resolved =
+        rootContext()->resolvePeer(::Wasm::Common::kUpstreamMetadataKey,
+                                   upstream_metadata_id->view()) ||
+        rootContext()->updatePeer(::Wasm::Common::kUpstreamMetadataKey,
+                                  upstream_metadata_id->view(),
+                                  upstream_metadata_value->view());
+    if (!peer_resolved) {
       LOG_DEBUG("cannot set upstream peer node");
     }
+  } else if (upstream_metadata_id_received) {
+    // the peer expects its metadata to be cached from an earlier exchange
+    peer_resolved = resolveUpstreamPeer(upstream_metadata_id->view());
+    if (!peer_resolved) {
+      LOG_DEBUG("cannot resolve upstream peer node");
+      rootContext()->requestResend();
+    }
+  }
+
+  if (peer_resolved && !authority_.empty()) {
+    rootContext()->addUpstreamPeer(authority_, upstream_metadata_id->view());
+  }
+
+  if (upstream_metadata_id_received) {
+    setFilterState(::Wasm::Common::kUpstreamMetadataIdKey,
+                   peer_resolved ? upstream_metadata_id->view()
+                                 : ::Wasm::Common::kMetadataNotFoundValue);
+  }
+
+  // Requests always carry the full metadata, so a resend asked for by the
+  // upstream peer is already satisfied by the next request.
+  auto upstream_metadata_resend =
+      getResponseHeader(ExchangeMetadataHeaderResend);
+  if (upstream_metadata_resend != nullptr &&
+      !upstream_metadata_resend->view().empty()) {
+    removeResponseHeader(ExchangeMetadataHeaderResend);
   }
 
   // do not send response internal headers to sidecar app if it is an outbound
   // proxy
   if (direction_ != ::Wasm::Common::TrafficDirection::Outbound) {
     auto metadata = metadataValue();
+    // reply in the compact format only to peers that advertised it
+    if (compact_metadata_accepted_ && rootContext()->compactMetadata()) {
+      metadata = rootContext()->compactMetadataValue();
+    }
+    auto nodeid = nodeId();
+    // Only the peers that listed the local ID hold the local metadata for
+    // sure, so every other peer gets the full metadata.
+    bool id_only = rootContext()->idOnlyMetadata() && !nodeid.empty() &&
+                   local_metadata_known_ && !resend_requested_;
     // insert peer metadata struct for downstream
-    if (!metadata.empty() && metadata_received_) {
+    if (!metadata.empty() && metadata_received_ && !id_only) {
       replaceResponseHeader(ExchangeMetadataHeader, metadata);
     }
 
-    auto nodeid = nodeId();
     if (!nodeid.empty() && metadata_id_received_) {
       replaceResponseHeader(ExchangeMetadataHeaderId, nodeid);
     }
+
+    if (peer_metadata_missing_) {
+      replaceResponseHeader(ExchangeMetadataHeaderResend, "1");
+    }
   }
 
   return FilterHeadersStatus::Continue;
 }
 
+bool PluginContext::resolveUpstreamPeer(std::string_view peer_id) {
+  if (rootContext()->resolvePeer(::Wasm::Common::kUpstreamMetadataKey,
+                                 peer_id)) {
+    return true;
+  }
+  // The peer was listed as known, but evicted from the cache since.
+  for (const auto& peer : known_upstream_peers_) {
+    if (peer.first == peer_id) {
+      rootContext()->restorePeer(::Wasm::Common::kUpstreamMetadataKey, peer);
+      return true;
+    }
+  }
+  return false;
+}
+
 #ifdef NULL_PLUGIN
 }  // namespace Plugin
 }  // namespace MetadataExchange
@@ -15,7 +15,14 @@
 
 #pragma once
 
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 #include "extensions/common/context.h"
+#include "extensions/common/peer_cache.h"
 
 #ifndef NULL_PLUGIN
 
@@ -40,7 +47,60 @@ namespace Plugin {
 constexpr std::string_view ExchangeMetadataHeader = "x-envoy-peer-metadata";
 constexpr std::string_view ExchangeMetadataHeaderId =
     "x-envoy-peer-metadata-id";
-const size_t DefaultNodeCacheMaxSize = 500;
+// Advertises the comma separated metadata formats understood by the
+// downstream peer.
+constexpr std::string_view ExchangeMetadataHeaderAccept =
+    "x-envoy-peer-metadata-accept";
+// Asks the peer to send its full metadata, after its ID was not found in the
+// peer cache.
+constexpr std::string_view ExchangeMetadataHeaderResend =
+    "x-envoy-peer-metadata-resend";
+// Lists the comma separated IDs of the upstream peers whose metadata the
+// downstream peer holds for the request authority. Listed peers reply with
+// their ID only.
+constexpr std::string_view ExchangeMetadataHeaderKnown =
+    "x-envoy-peer-metadata-known";
+// Version of the compact metadata format.
+constexpr std::string_view CompactMetadataFormat = "fb1";
+// Compact metadata is the base64 encoded peer FlatNode, prefixed with the
+// format version. The separator is not in the base64 alphabet, which tells it
+// apart from the base64 encoded Struct sent by older peers.
+constexpr std::string_view CompactMetadataPrefix = "fb1.";
+const size_t DefaultNodeCacheMaxSize =
+    ::Wasm::Common::kDefaultPeerCacheMaxSize;
+// Maximum number of upstream peer IDs listed as known for an authority.
+constexpr size_t MaxKnownUpstreamPeers = 4;
+
+// Upstream peer held by a stream while its ID is listed as known, so that an
+// ID-only reply resolves even if the peer is evicted from the cache meanwhile.
+using KnownPeer = std::pair<std::string, ::Wasm::Common::PeerNodePtr>;
+
+// UpstreamPeers keeps the IDs of the upstream peers that recently replied to
+// the requests for an authority, most recent first. Least recently used
+// authorities are evicted beyond the limit. Not thread-safe.
+class UpstreamPeers {
+ public:
+  void setMaxAuthorities(size_t max_authorities) {
+    max_authorities_ = max_authorities;
+  }
+
+  // Returns the peer IDs of the authority and marks it as most recently used,
+  // or nullptr if the authority is absent.
+  std::vector<std::string>* find(const std::string& authority);
+  void add(const std::string& authority, std::string_view peer_id);
+
+ private:
+  struct Entry {
+    std::vector<std::string> peer_ids;
+    // Position in the recency list, which points back at the map key.
+    std::list<const std::string*>::iterator lru;
+  };
+
+  std::unordered_map<std::string, Entry> entries_;
+  // Most recently used first.
+  std::list<const std::string*> lru_;
+  size_t max_authorities_ = DefaultNodeCacheMaxSize;
+};
 
 // PluginRootContext is the root context for all streams processed by the
 // thread. It has the same lifetime as the worker thread and acts as target for
@@ -48,23 +108,75 @@ const size_t DefaultNodeCacheMaxSize = 500;
 class PluginRootContext : public RootContext {
  public:
   PluginRootContext(uint32_t id, std::string_view root_id)
-      : RootContext(id, root_id) {}
+      : RootContext(id, root_id) {
+    Metric cache_count(MetricType::Counter, "peer_cache_count",
+                       {MetricTag{"wasm_filter", MetricTag::TagType::String},
+                        MetricTag{"cache", MetricTag::TagType::String}});
+    cache_hits_ = cache_count.resolve("metadata_exchange", "hit");
+    cache_misses_ = cache_count.resolve("metadata_exchange", "miss");
+    cache_evictions_ = cache_count.resolve("metadata_exchange", "eviction");
+  }
   bool onConfigure(size_t) override;
   bool configure(size_t);
 
   std::string_view metadataValue() { return metadata_value_; };
+  std::string_view compactMetadataValue() { return compact_metadata_value_; };
+  bool compactMetadata() const { return compact_metadata_; }
+  bool idOnlyMetadata() const { return id_only_metadata_; }
+  std::string_view acceptValue() { return accept_value_; }
   std::string_view nodeId() { return node_id_; };
+  // Decodes the peer metadata header and adds the peer to the cache.
   bool updatePeer(std::string_view key, std::string_view peer_id,
                   std::string_view peer_header);
+  // Sets the peer metadata from the cache, for peers sending their ID only.
+  bool resolvePeer(std::string_view key, std::string_view peer_id);
+  // Sets the metadata of a peer held by the stream, and adds the peer back to
+  // the cache.
+  void restorePeer(std::string_view key, const KnownPeer& peer);
+
+  // Returns the cached upstream peers that recently replied to the requests
+  // for the authority.
+  std::vector<KnownPeer> knownUpstreamPeers(const std::string& authority);
+  // Records an upstream peer resolved from the reply to a request.
+  void addUpstreamPeer(const std::string& authority, std::string_view peer_id) {
+    upstream_peers_.add(authority, peer_id);
+  }
+
+  // Upstream peer IDs missing from the cache are asked for by the next
+  // request, whichever upstream peer receives it.
+  bool takeResendRequest() {
+    bool resend = request_resend_;
+    request_resend_ = false;
+    return resend;
+  }
+  void requestResend() { request_resend_ = true; }
 
  private:
   void updateMetadataValue();
   std::string metadata_value_;
+  std::string compact_metadata_value_;
   std::string node_id_;
+  bool compact_metadata_{false};
+  bool id_only_metadata_{false};
+  std::string accept_value_;
+  bool request_resend_{false};
+  UpstreamPeers upstream_peers_;
 
-  // maps peer ID to the decoded peer flat buffer
-  std::unordered_map<std::string, std::string> cache_;
+#ifdef NULL_PLUGIN
+  // Decoded peers are shared by the worker threads of the process.
+  ::Wasm::Common::SharedPeerCache& cache_ =
+      ::Wasm::Common::SharedPeerCache::get();
+#else
+  ::Wasm::Common::PeerCache cache_;
+#endif
   int64_t max_peer_cache_size_{DefaultNodeCacheMaxSize};
+  int64_t max_peer_cache_bytes_{0};
+
+  // Hits are accumulated to save a host call per cached peer.
+  int64_t cache_hits_accumulator_ = 0;
+  uint32_t cache_hits_;
+  uint32_t cache_misses_;
+  uint32_t cache_evictions_;
 };
 
 // Per-stream context.
@@ -86,9 +198,22 @@ class PluginContext : public Context {
   };
   inline std::string_view nodeId() { return rootContext()->nodeId(); }
 
+  // Sets the upstream peer metadata from the cache or the peers held by the
+  // stream.
+  bool resolveUpstreamPeer(std::string_view peer_id);
+
   ::Wasm::Common::TrafficDirection direction_;
   bool metadata_received_{true};
+  // The downstream peer listed the local ID as known, so it holds the local
+  // metadata until the reply.
+  bool local_metadata_known_{false};
+  bool peer_metadata_missing_{false};
+  bool resend_requested_{false};
+  bool compact_metadata_accepted_{false};
   bool metadata_id_received_{true};
+  // Authority of the request, and the upstream peers listed as known for it.
+  std::string authority_;
+  std::vector<KnownPeer> known_upstream_peers_;
 };
 
 #ifdef NULL_PLUGIN
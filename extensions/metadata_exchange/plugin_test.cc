@@ -0,0 +1,259 @@
+/* Copyright 2020 Istio Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the metadata exchange headers. The plugin runs in the null VM
+// against a stand-in host that keeps the headers and the filter state.
+
+#include <memory>
+
+#include "absl/strings/str_cat.h"
+#include "common/common/base64.h"
+#include "extensions/common/context.h"
+#include "extensions/common/fake_host.h"
+#include "extensions/common/peer_cache.h"
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace MetadataExchange {
+
+using Envoy::Extensions::Testing::FakeHost;
+using Envoy::Extensions::Testing::NullVmPlugin;
+using Envoy::Extensions::Testing::peerFlatNode;
+using Envoy::Extensions::Testing::propertyPath;
+
+constexpr std::string_view kMetadataHeader = "x-envoy-peer-metadata";
+constexpr std::string_view kMetadataIdHeader = "x-envoy-peer-metadata-id";
+constexpr std::string_view kResendHeader = "x-envoy-peer-metadata-resend";
+constexpr std::string_view kKnownHeader = "x-envoy-peer-metadata-known";
+
+constexpr std::string_view kIdOnlyConfig = R"EOF({
+  "id_only_metadata": true
+})EOF";
+
+// Returns the compact metadata header value of the i-th peer workload.
+std::string compactMetadata(size_t i) {
+  auto node = peerFlatNode(i);
+  return absl::StrCat("fb1.", Base64::encode(node.data(), node.size()));
+}
+
+std::string header(const FakeHost::HeaderMap& headers, std::string_view key) {
+  auto it = headers.find(key);
+  return it == headers.end() ? "" : it->second;
+}
+
+class MetadataExchangeTest : public testing::Test {
+ protected:
+  // Peers are cached process wide, so every test uses its own peer IDs.
+  void load(::Wasm::Common::TrafficDirection direction,
+            std::string_view configuration) {
+    host_.setProperty({"node", "id"}, "local-id");
+    host_.setProperty({"node", "metadata", "NAME"}, "local-name");
+    host_.setProperty({"listener_direction"},
+                      static_cast<int64_t>(direction));
+    plugin_ = std::make_unique<NullVmPlugin>(
+        host_, "envoy.wasm.metadata_exchange", "metadata_exchange",
+        configuration,
+        direction == ::Wasm::Common::TrafficDirection::Inbound
+            ? envoy::config::core::v3::TrafficDirection::INBOUND
+            : envoy::config::core::v3::TrafficDirection::OUTBOUND);
+  }
+
+  // Sends the request headers of a new stream from the downstream peer.
+  void sendRequest(const FakeHost::HeaderMap& headers) {
+    host_.request_headers = headers;
+    host_.response_headers.clear();
+    stream_ = plugin_->newStream();
+    stream_->onRequestHeaders(0, false);
+  }
+
+  // Sends the response headers of the stream from the upstream peer.
+  void sendResponse(const FakeHost::HeaderMap& headers) {
+    host_.response_headers = headers;
+    stream_->onResponseHeaders(0, false);
+    stream_->onDelete();
+    stream_.reset();
+  }
+
+  std::string filterState(std::string_view key) {
+    auto it = host_.properties.find(propertyPath({key}));
+    return it == host_.properties.end() ? "" : it->second;
+  }
+
+  // Runs a stream of the stats plugin after the exchange, and returns the
+  // number of metric records.
+  uint64_t report(envoy::config::core::v3::TrafficDirection direction) {
+    host_.setProperty({"response", "code"}, 200);
+    host_.request_headers[":method"] = "GET";
+    NullVmPlugin stats(host_, "envoy.wasm.stats", "stats", "{}", direction);
+    auto stream = stats.newStream();
+    stream->onRequestHeaders(0, false);
+    stream->onResponseHeaders(0, false);
+    stream->onLog();
+    stream->onDelete();
+    return host_.records;
+  }
+
+  FakeHost host_;
+  std::unique_ptr<NullVmPlugin> plugin_;
+  std::unique_ptr<Envoy::Extensions::Common::Wasm::Context> stream_;
+};
+
+// The upstream peer is not known when a request is sent, so every request
+// carries the full metadata along with its ID, and lists the upstream peers
+// that replied for the authority before.
+TEST_F(MetadataExchangeTest, RequestsCarryFullMetadata) {
+  load(::Wasm::Common::TrafficDirection::Outbound, kIdOnlyConfig);
+  for (int i = 0; i < 3; i++) {
+    sendRequest({{":authority", "svc-full"}});
+    EXPECT_FALSE(header(host_.request_headers, kMetadataHeader).empty());
+    EXPECT_EQ(header(host_.request_headers, kMetadataIdHeader), "local-id");
+    EXPECT_EQ(header(host_.request_headers, kKnownHeader),
+              i == 0 ? "" : "upstream-full");
+    sendResponse({{std::string(kMetadataIdHeader), "upstream-full"},
+                  {std::string(kMetadataHeader), compactMetadata(1)}});
+  }
+}
+
+// Responses carry the ID only to the peers that list the local ID as known.
+TEST_F(MetadataExchangeTest, RepliesIdOnlyToPeersHoldingMetadata) {
+  load(::Wasm::Common::TrafficDirection::Inbound, kIdOnlyConfig);
+  const FakeHost::HeaderMap request = {
+      {std::string(kMetadataIdHeader), "downstream-known"},
+      {std::string(kMetadataHeader), compactMetadata(2)}};
+
+  sendRequest(request);
+  sendResponse({});
+  EXPECT_FALSE(header(host_.response_headers, kMetadataHeader).empty());
+  EXPECT_EQ(header(host_.response_headers, kMetadataIdHeader), "local-id");
+
+  auto known = request;
+  known[std::string(kKnownHeader)] = "other-id,local-id";
+  sendRequest(known);
+  EXPECT_EQ(header(host_.request_headers, kKnownHeader), "");
+  sendResponse({});
+  EXPECT_EQ(header(host_.response_headers, kMetadataHeader), "");
+  EXPECT_EQ(header(host_.response_headers, kMetadataIdHeader), "local-id");
+
+  auto resend = known;
+  resend[std::string(kResendHeader)] = "1";
+  sendRequest(resend);
+  sendResponse({});
+  EXPECT_FALSE(header(host_.response_headers, kMetadataHeader).empty());
+}
+
+// The downstream peer being cached locally does not mean that it holds the
+// local metadata, so peers that do not list the local ID get the full
+// metadata.
+TEST_F(MetadataExchangeTest, RepliesFullMetadataToOtherPeers) {
+  load(::Wasm::Common::TrafficDirection::Inbound, kIdOnlyConfig);
+  const FakeHost::HeaderMap request = {
+      {std::string(kMetadataIdHeader), "downstream-full"},
+      {std::string(kMetadataHeader), compactMetadata(3)},
+      {std::string(kKnownHeader), "other-id"}};
+  for (int i = 0; i < 2; i++) {
+    sendRequest(request);
+    sendResponse({});
+    EXPECT_FALSE(header(host_.response_headers, kMetadataHeader).empty());
+  }
+}
+
+// An upstream peer evicted from the cache while a request listing it is in
+// flight is resolved from the stream, and keeps its labels.
+TEST_F(MetadataExchangeTest, UpstreamPeerEvictedDuringRequest) {
+  load(::Wasm::Common::TrafficDirection::Outbound, kIdOnlyConfig);
+  sendRequest({{":authority", "svc-evicted"}});
+  sendResponse({{std::string(kMetadataIdHeader), "upstream-evicted"},
+                {std::string(kMetadataHeader), compactMetadata(5)}});
+
+  sendRequest({{":authority", "svc-evicted"}});
+  EXPECT_EQ(header(host_.request_headers, kKnownHeader), "upstream-evicted");
+  ::Wasm::Common::SharedPeerCache::get().clear();
+  sendResponse({{std::string(kMetadataIdHeader), "upstream-evicted"}});
+  EXPECT_EQ(filterState(::Wasm::Common::kUpstreamMetadataIdKey),
+            "upstream-evicted");
+  EXPECT_EQ(filterState(::Wasm::Common::kUpstreamMetadataKey),
+            peerFlatNode(5));
+  EXPECT_GT(report(envoy::config::core::v3::TrafficDirection::OUTBOUND), 0);
+
+  // The peer is cached again, and no resend is needed.
+  sendRequest({{":authority", "svc-evicted"}});
+  EXPECT_EQ(header(host_.request_headers, kKnownHeader), "upstream-evicted");
+  EXPECT_EQ(header(host_.request_headers, kResendHeader), "");
+}
+
+// An upstream peer evicted before a request is not listed, so that it replies
+// with the full metadata.
+TEST_F(MetadataExchangeTest, UpstreamPeerEvictedBeforeRequest) {
+  load(::Wasm::Common::TrafficDirection::Outbound, kIdOnlyConfig);
+  sendRequest({{":authority", "svc-forgotten"}});
+  sendResponse({{std::string(kMetadataIdHeader), "upstream-forgotten"},
+                {std::string(kMetadataHeader), compactMetadata(6)}});
+
+  ::Wasm::Common::SharedPeerCache::get().clear();
+  sendRequest({{":authority", "svc-forgotten"}});
+  EXPECT_EQ(header(host_.request_headers, kKnownHeader), "");
+}
+
+// A downstream peer ID missing from the cache is not published as the peer
+// ID, and the report uses the fallback peer.
+TEST_F(MetadataExchangeTest, DownstreamPeerCacheMiss) {
+  load(::Wasm::Common::TrafficDirection::Inbound, kIdOnlyConfig);
+  sendRequest({{std::string(kMetadataIdHeader), "downstream-missing"}});
+  EXPECT_EQ(filterState(::Wasm::Common::kDownstreamMetadataIdKey),
+            ::Wasm::Common::kMetadataNotFoundValue);
+  EXPECT_EQ(filterState(::Wasm::Common::kDownstreamMetadataKey), "");
+  sendResponse({});
+  EXPECT_EQ(header(host_.response_headers, kResendHeader), "1");
+  EXPECT_GT(report(envoy::config::core::v3::TrafficDirection::INBOUND), 0);
+}
+
+TEST_F(MetadataExchangeTest, DownstreamPeerDecodeFailure) {
+  load(::Wasm::Common::TrafficDirection::Inbound, kIdOnlyConfig);
+  sendRequest({{std::string(kMetadataIdHeader), "downstream-corrupt"},
+               {std::string(kMetadataHeader), "fb1.AAAA"}});
+  EXPECT_EQ(filterState(::Wasm::Common::kDownstreamMetadataIdKey),
+            ::Wasm::Common::kMetadataNotFoundValue);
+  sendResponse({});
+  EXPECT_GT(report(envoy::config::core::v3::TrafficDirection::INBOUND), 0);
+}
+
+TEST_F(MetadataExchangeTest, UpstreamPeerCacheMiss) {
+  load(::Wasm::Common::TrafficDirection::Outbound, kIdOnlyConfig);
+  sendRequest({});
+  sendResponse({{std::string(kMetadataIdHeader), "upstream-missing"}});
+  EXPECT_EQ(filterState(::Wasm::Common::kUpstreamMetadataIdKey),
+            ::Wasm::Common::kMetadataNotFoundValue);
+  EXPECT_GT(report(envoy::config::core::v3::TrafficDirection::OUTBOUND), 0);
+
+  // The next request asks for the full metadata of the upstream peer.
+  sendRequest({});
+  EXPECT_EQ(header(host_.request_headers, kResendHeader), "1");
+}
+
+TEST_F(MetadataExchangeTest, ResolvedPeerIdIsPublished) {
+  load(::Wasm::Common::TrafficDirection::Inbound, kIdOnlyConfig);
+  sendRequest({{std::string(kMetadataIdHeader), "downstream-resolved"},
+               {std::string(kMetadataHeader), compactMetadata(4)}});
+  EXPECT_EQ(filterState(::Wasm::Common::kDownstreamMetadataIdKey),
+            "downstream-resolved");
+  EXPECT_EQ(filterState(::Wasm::Common::kDownstreamMetadataKey),
+            peerFlatNode(4));
+  sendResponse({});
+}
+
+}  // namespace MetadataExchange
+}  // namespace Extensions
+}  // namespace Envoy
@@ -138,7 +138,7 @@ EdgeReporter::~EdgeReporter() {}
 
 // ONLY inbound
 void EdgeReporter::addEdge(const ::Wasm::Common::RequestInfo& request_info,
-                           const std::string& peer_metadata_id_key,
+                           std::string_view peer_metadata_id_key,
                            const ::Wasm::Common::FlatNode& peer_node_info) {
   const auto& peer = known_peers_.emplace(peer_metadata_id_key);
   if (!peer.second) {
@@ -16,6 +16,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "extensions/common/context.h"
@@ -71,7 +72,7 @@ class EdgeReporter {
   // the supplied request / peer info. The new edge is added to the
   // pending request that will be sent with all generated edges.
   void addEdge(const ::Wasm::Common::RequestInfo& request_info,
-               const std::string& peer_metadata_id_key,
+               std::string_view peer_metadata_id_key,
                const ::Wasm::Common::FlatNode& peer_node_info);
 
   // reportEdges sends the buffered requests to the configured edges
@@ -16,9 +16,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include "extensions/stackdriver/common/utils.h"
-#include "google/logging/v2/logging.pb.h"
 
 #ifndef NULL_PLUGIN
 #include "api/wasm/cpp/proxy_wasm_intrinsics.h"
@@ -39,10 +39,9 @@ class Exporter {
  public:
   virtual ~Exporter() {}
 
-  virtual void exportLogs(
-      const std::vector<
-          std::unique_ptr<const google::logging::v2::WriteLogEntriesRequest>>&,
-      bool is_on_done) = 0;
+  // Exports serialized WriteLogEntriesRequests.
+  virtual void exportLogs(const std::vector<std::string>&,
+                          bool is_on_done) = 0;
 };
 
 // Exporter writes Stackdriver access log to the backend. It uses WebAssembly
@@ -57,8 +56,7 @@ class ExporterImpl : public Exporter {
                    stub_option);
 
   // exportLogs exports the given log request to Stackdriver.
-  void exportLogs(const std::vector<std::unique_ptr<
-                      const google::logging::v2::WriteLogEntriesRequest>>& req,
+  void exportLogs(const std::vector<std::string>& req,
                   bool is_on_done) override;
 
  private:
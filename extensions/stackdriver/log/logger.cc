@@ -18,6 +18,7 @@
 #include "absl/strings/match.h"
 #include "extensions/stackdriver/common/constants.h"
 #include "google/logging/v2/log_entry.pb.h"
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/util/time_util.h"
 #include "re2/re2.h"
 
@@ -41,6 +42,18 @@ const RE2 rbac_denied_match(
     ".*)\\]\\]");
 constexpr char rbac_denied_match_prefix[] = "rbac_access_denied_matched_policy";
 constexpr char kRbacAccessDenied[] = "AuthzDenied";
+
+// Sets a label from a flat buffer string, without a temporary copy.
+void setLabel(google::protobuf::Map<std::string, std::string>* label_map,
+              const std::string& key, const flatbuffers::String* value) {
+  auto& label = (*label_map)[key];
+  if (value) {
+    label.assign(value->c_str(), value->size());
+  } else {
+    label.clear();
+  }
+}
+
 void setSourceCanonicalService(
     const ::Wasm::Common::FlatNode& peer_node_info,
     google::protobuf::Map<std::string, std::string>* label_map) {
@@ -49,8 +62,7 @@ void setSourceCanonicalService(
     auto ics_iter = peer_labels->LookupByKey(
         Wasm::Common::kCanonicalServiceLabelName.data());
     if (ics_iter) {
-      (*label_map)["source_canonical_service"] =
-          flatbuffers::GetString(ics_iter->value());
+      setLabel(label_map, "source_canonical_service", ics_iter->value());
     }
   }
 }
@@ -63,8 +75,7 @@ void setDestinationCanonicalService(
     auto ics_iter = peer_labels->LookupByKey(
         Wasm::Common::kCanonicalServiceLabelName.data());
     if (ics_iter) {
-      (*label_map)["destination_canonical_service"] =
-          flatbuffers::GetString(ics_iter->value());
+      setLabel(label_map, "destination_canonical_service", ics_iter->value());
     }
   }
 }
@@ -85,15 +96,14 @@ void setMonitoredResource(
 void fillDestinationLabels(
     const ::Wasm::Common::FlatNode& destination_node_info,
     google::protobuf::Map<std::string, std::string>* label_map, bool audit) {
-  (*label_map)["destination_workload"] =
-      flatbuffers::GetString(destination_node_info.workload_name());
-  (*label_map)["destination_namespace"] =
-      flatbuffers::GetString(destination_node_info.namespace_());
+  setLabel(label_map, "destination_workload",
+           destination_node_info.workload_name());
+  setLabel(label_map, "destination_namespace",
+           destination_node_info.namespace_());
 
   // Don't set if audit request
   if (!audit) {
-    (*label_map)["destination_name"] =
-        flatbuffers::GetString(destination_node_info.name());
+    setLabel(label_map, "destination_name", destination_node_info.name());
   }
 
   // Add destination app and version label if exist.
@@ -101,14 +111,12 @@ void fillDestinationLabels(
   if (local_labels) {
     auto version_iter = local_labels->LookupByKey("version");
     if (version_iter && !audit) {
-      (*label_map)["destination_version"] =
-          flatbuffers::GetString(version_iter->value());
+      setLabel(label_map, "destination_version", version_iter->value());
     }
     // App label is used to correlate workload and its logs in UI.
     auto app_iter = local_labels->LookupByKey("app");
     if (app_iter) {
-      (*label_map)["destination_app"] =
-          flatbuffers::GetString(app_iter->value());
+      setLabel(label_map, "destination_app", app_iter->value());
     }
     if (label_map->find("destination_canonical_service") == label_map->end()) {
       setDestinationCanonicalService(destination_node_info, label_map);
@@ -116,8 +124,7 @@ void fillDestinationLabels(
     auto rev_iter = local_labels->LookupByKey(
         Wasm::Common::kCanonicalServiceRevisionLabelName.data());
     if (rev_iter) {
-      (*label_map)["destination_canonical_revision"] =
-          flatbuffers::GetString(rev_iter->value());
+      setLabel(label_map, "destination_canonical_revision", rev_iter->value());
     }
   }
 }
@@ -128,25 +135,21 @@ void fillSourceLabels(
     const ::Wasm::Common::FlatNode& source_node_info,
     google::protobuf::Map<std::string, std::string>* label_map, bool audit) {
   if (!audit) {
-    (*label_map)["source_name"] =
-        flatbuffers::GetString(source_node_info.name());
+    setLabel(label_map, "source_name", source_node_info.name());
   }
-  (*label_map)["source_workload"] =
-      flatbuffers::GetString(source_node_info.workload_name());
-  (*label_map)["source_namespace"] =
-      flatbuffers::GetString(source_node_info.namespace_());
+  setLabel(label_map, "source_workload", source_node_info.workload_name());
+  setLabel(label_map, "source_namespace", source_node_info.namespace_());
   // Add destination app and version label if exist.
   const auto local_labels = source_node_info.labels();
   if (local_labels) {
     auto version_iter = local_labels->LookupByKey("version");
     if (version_iter && !audit) {
-      (*label_map)["source_version"] =
-          flatbuffers::GetString(version_iter->value());
+      setLabel(label_map, "source_version", version_iter->value());
     }
     // App label is used to correlate workload and its logs in UI.
     auto app_iter = local_labels->LookupByKey("app");
     if (app_iter) {
-      (*label_map)["source_app"] = flatbuffers::GetString(app_iter->value());
+      setLabel(label_map, "source_app", app_iter->value());
     }
     if (label_map->find("source_canonical_service") == label_map->end()) {
       setSourceCanonicalService(source_node_info, label_map);
@@ -154,8 +157,7 @@ void fillSourceLabels(
     auto rev_iter = local_labels->LookupByKey(
         Wasm::Common::kCanonicalServiceRevisionLabelName.data());
     if (rev_iter) {
-      (*label_map)["source_canonical_revision"] =
-          flatbuffers::GetString(rev_iter->value());
+      setLabel(label_map, "source_canonical_revision", rev_iter->value());
     }
   }
 }
@@ -199,6 +201,9 @@ constexpr char kServerAuditLogName[] = "server-istio-audit-log";
 // Name of the client audit access log.
 constexpr char kClientAuditLogName[] = "client-istio-audit-log";
 
+// Size of the tag of WriteLogEntriesRequest.entries.
+constexpr size_t kEntriesFieldTagSize = 1;
+
 void Logger::initializeLogEntryRequest(
     const flatbuffers::Vector<flatbuffers::Offset<Wasm::Common::KeyVal>>*
         platform_metadata,
@@ -206,11 +211,8 @@ void Logger::initializeLogEntryRequest(
     const std::unordered_map<std::string, std::string>& extra_labels,
     bool outbound, bool audit) {
   LogEntryType log_entry_type = GetLogEntryType(outbound, audit);
-  log_entries_request_map_[log_entry_type]->request =
-      std::make_unique<google::logging::v2::WriteLogEntriesRequest>();
-  log_entries_request_map_[log_entry_type]->size = 0;
   auto log_entries_request =
-      log_entries_request_map_[log_entry_type]->request.get();
+      &log_entries_request_map_[log_entry_type]->shared_fields;
   const std::string& log_name =
       audit ? (outbound ? kClientAuditLogName : kServerAuditLogName)
             : (outbound ? kClientAccessLogName : kServerAccessLogName);
@@ -232,8 +234,7 @@ void Logger::initializeLogEntryRequest(
   setMonitoredResource(local_node_info, resource_type, log_entries_request);
   auto label_map = log_entries_request->mutable_labels();
   if (!audit) {
-    (*label_map)["mesh_uid"] =
-        flatbuffers::GetString(local_node_info.mesh_id());
+    setLabel(label_map, "mesh_uid", local_node_info.mesh_id());
   }
 
   // Set common labels shared by all client entries or server entries
@@ -242,6 +243,18 @@ void Logger::initializeLogEntryRequest(
   if (!audit) {
     fillExtraLabels(extra_labels, label_map);
   }
+
+  // Serialized once, since it is the same for every request of the type.
+  log_entries_request->SerializeToString(
+      &log_entries_request_map_[log_entry_type]->serialized_shared_fields);
+  newLogEntryRequest(log_entry_type);
+}
+
+void Logger::newLogEntryRequest(LogEntryType log_entry_type) {
+  auto& entries_request = *log_entries_request_map_[log_entry_type];
+  entries_request.request = google::protobuf::Arena::CreateMessage<
+      google::logging::v2::WriteLogEntriesRequest>(&arena_);
+  entries_request.size = entries_request.serialized_shared_fields.size();
 }
 
 Logger::Logger(const ::Wasm::Common::FlatNode& local_node_info,
@@ -389,29 +402,46 @@ void Logger::fillAndFlushLogEntry(
     fillExtraLabels(extra_labels, new_entry->mutable_labels());
   }
   LogEntryType log_entry_type = GetLogEntryType(outbound, audit);
-  // Accumulate estimated size of the request. If the current request exceeds
-  // the size limit, flush the request out.
-  log_entries_request_map_[log_entry_type]->size += new_entry->ByteSizeLong();
-  if (log_entries_request_map_[log_entry_type]->size >
+  auto& entries_request = *log_entries_request_map_[log_entry_type];
+  // Accumulate the serialized size of the request, which is the size of the
+  // entry plus its tag and length prefix in the repeated entries field.
+  const size_t entry_size = new_entry->ByteSizeLong();
+  const size_t framed_entry_size =
+      kEntriesFieldTagSize +
+      google::protobuf::io::CodedOutputStream::VarintSize64(entry_size) +
+      entry_size;
+  if (entries_request.serialized_shared_fields.size() + framed_entry_size >
       log_request_size_limit_) {
+    // The entry does not fit even in a request of its own, so drop it rather
+    // than export a request over the limit.
+    entries_request.request->mutable_entries()->RemoveLast();
+    dropped_log_entries_++;
+    return;
+  }
+  if (entries_request.size + framed_entry_size > log_request_size_limit_ &&
+      entries_request.request->entries_size() > 1) {
+    // The entry does not fit, so move it to a new request.
+    auto* entry =
+        entries_request.request->mutable_entries()->UnsafeArenaReleaseLast();
+    flush(log_entry_type);
+    entries_request.request->mutable_entries()->UnsafeArenaAddAllocated(entry);
+  }
+  entries_request.size += framed_entry_size;
+  if (entries_request.size >= log_request_size_limit_) {
     flush(log_entry_type);
   }
 }
 
 void Logger::flush(LogEntryType log_entry_type) {
-  auto request = log_entries_request_map_[log_entry_type]->request.get();
-  std::unique_ptr<google::logging::v2::WriteLogEntriesRequest> cur =
-      std::make_unique<google::logging::v2::WriteLogEntriesRequest>();
-  cur->set_log_name(request->log_name());
-  cur->mutable_resource()->CopyFrom(request->resource());
-  *cur->mutable_labels() = request->labels();
-
-  // Swap the new request with the old one and export it.
-  log_entries_request_map_[log_entry_type]->request.swap(cur);
-  request_queue_.emplace_back(std::move(cur));
-
-  // Reset size counter.
-  log_entries_request_map_[log_entry_type]->size = 0;
+  // Queue the current request for export and start a new one. The shared
+  // fields precede the entries in field number order, so the request is
+  // serialized by appending the entries to them.
+  auto& entries_request = *log_entries_request_map_[log_entry_type];
+  std::string& serialized = request_queue_.emplace_back();
+  serialized.reserve(entries_request.size);
+  serialized.append(entries_request.serialized_shared_fields);
+  entries_request.request->AppendToString(&serialized);
+  newLogEntryRequest(log_entry_type);
 }
 
 bool Logger::flush() {
@@ -420,7 +450,7 @@ bool Logger::flush() {
   // This flush is triggered by timer, thus iterate through the map to see if
   // any log entry is non empty.
   for (auto const& log_entry : log_entries_request_map_) {
-    if (log_entry.second->size != 0) {
+    if (log_entry.second->request->entries_size() != 0) {
       flush(log_entry.first);
       flushed = true;
     }
@@ -436,6 +466,13 @@ bool Logger::exportLogEntry(bool is_on_done) {
   }
   exporter_->exportLogs(request_queue_, is_on_done);
   request_queue_.clear();
+
+  // The current requests are empty after the flush, so the arena is reset and
+  // they are started over.
+  arena_.Reset();
+  for (auto const& log_entry : log_entries_request_map_) {
+    newLogEntryRequest(log_entry.first);
+  }
   return true;
 }
 
@@ -443,18 +480,18 @@ void Logger::addTCPLabelsToLogEntry(
     const ::Wasm::Common::RequestInfo& request_info,
     const ::Wasm::Common::FlatNode& peer_node_info,
     google::logging::v2::LogEntry* log_entry, bool outbound, bool audit) {
-  const auto& entries_request =
-      log_entries_request_map_[GetLogEntryType(outbound, audit)]->request;
+  const auto& shared_fields =
+      log_entries_request_map_[GetLogEntryType(outbound, audit)]->shared_fields;
   auto label_map = log_entry->mutable_labels();
   std::string source, destination;
   if (outbound) {
     setDestinationCanonicalService(peer_node_info, label_map);
     auto source_cs_iter =
-        entries_request->labels().find("source_canonical_service");
+        shared_fields.labels().find("source_canonical_service");
     auto destination_cs_iter = label_map->find("destination_canonical_service");
-    source = source_cs_iter != entries_request->labels().end()
+    source = source_cs_iter != shared_fields.labels().end()
                  ? source_cs_iter->second
-                 : entries_request->labels().at("source_workload");
+                 : shared_fields.labels().at("source_workload");
     destination = destination_cs_iter != label_map->end()
                       ? destination_cs_iter->second
                       : request_info.destination_service_name;
@@ -462,11 +499,11 @@ void Logger::addTCPLabelsToLogEntry(
     setSourceCanonicalService(peer_node_info, label_map);
     auto source_cs_iter = label_map->find("source_canonical_service");
     auto destination_cs_iter =
-        entries_request->labels().find("destination_canonical_service");
+        shared_fields.labels().find("destination_canonical_service");
     source = source_cs_iter != label_map->end()
                  ? source_cs_iter->second
                  : flatbuffers::GetString(peer_node_info.workload_name());
-    destination = destination_cs_iter != entries_request->labels().end()
+    destination = destination_cs_iter != shared_fields.labels().end()
                       ? destination_cs_iter->second
                       : request_info.destination_service_name;
   }
@@ -21,6 +21,7 @@
 #include "extensions/common/context.h"
 #include "extensions/stackdriver/log/exporter.h"
 #include "google/logging/v2/logging.pb.h"
+#include "google/protobuf/arena.h"
 
 namespace Extensions {
 namespace Stackdriver {
@@ -86,21 +87,34 @@ class Logger {
   // exported.
   bool exportLogEntry(bool is_on_done);
 
+  // Number of log entries dropped because they exceed the request size limit
+  // on their own.
+  uint64_t droppedLogEntries() const { return dropped_log_entries_; }
+
  private:
   // Stores log entry request and it's size.
   struct WriteLogEntryRequest {
-    // Request that the new log entry should be written into.
-    std::unique_ptr<google::logging::v2::WriteLogEntriesRequest> request;
-    // Estimated size of the current WriteLogEntriesRequest.
-    int size;
+    // Entries of the current WriteLogEntriesRequest, owned by arena_.
+    google::logging::v2::WriteLogEntriesRequest* request;
+    // Serialized size of the current WriteLogEntriesRequest, including the
+    // shared fields.
+    size_t size;
+    // Log name, resource and labels shared by all the requests of the type.
+    google::logging::v2::WriteLogEntriesRequest shared_fields;
+    // Serialized shared_fields, which precede the entries in every request of
+    // the type.
+    std::string serialized_shared_fields;
   };
 
-  // Flush rotates the current WriteLogEntriesRequest. This will be triggered
-  // either by a timer or by request size limit. Returns false if there is no
-  // log entry to be exported.
+  // Flush serializes and rotates the current WriteLogEntriesRequest. This will
+  // be triggered either by a timer or by request size limit. Returns false if
+  // there is no log entry to be exported.
   bool flush();
   void flush(LogEntryType log_entry_type);
 
+  // Starts a new WriteLogEntriesRequest of the given type on arena_.
+  void newLogEntryRequest(LogEntryType log_entry_type);
+
   // Add TCP Specific labels to LogEntry. Which labels are set depends on if
   // the entry is an audit entry or not
   void addTCPLabelsToLogEntry(const ::Wasm::Common::RequestInfo& request_info,
@@ -114,9 +128,10 @@ class Logger {
       google::logging::v2::LogEntry* log_entry);
 
   // Generic method to fill the log entry. The WriteLogEntriesRequest
-  // containing the log entry is flushed if the request exceeds the configured
-  // maximum size. Which request should be flushed is determined by the outbound
-  // and audit arguments.
+  // containing the log entry is flushed once it reaches the configured maximum
+  // size, and an entry which does not fit is moved to a new request. An entry
+  // larger than the maximum size on its own is dropped. Which request should
+  // be flushed is determined by the outbound and audit arguments.
   void fillAndFlushLogEntry(
       const ::Wasm::Common::RequestInfo& request_info,
       const ::Wasm::Common::FlatNode& peer_node_info,
@@ -148,10 +163,11 @@ class Logger {
     return Logger::LogEntryType::Server;
   }
 
-  // Buffer for WriteLogEntriesRequests that are to be exported.
-  std::vector<
-      std::unique_ptr<const google::logging::v2::WriteLogEntriesRequest>>
-      request_queue_;
+  // Arena of the log entries, which is reset once they are exported.
+  google::protobuf::Arena arena_;
+
+  // Buffer for serialized WriteLogEntriesRequests that are to be exported.
+  std::vector<std::string> request_queue_;
 
   // Stores client/server requests that the new log entry should be written
   // into.
@@ -160,8 +176,11 @@ class Logger {
       log_entries_request_map_;
 
   // Size limit of a WriteLogEntriesRequest. If current WriteLogEntriesRequest
-  // exceeds this size limit, flush() will be triggered.
-  int log_request_size_limit_;
+  // reaches this size limit, flush() will be triggered.
+  size_t log_request_size_limit_;
+
+  // Number of log entries dropped for exceeding log_request_size_limit_.
+  uint64_t dropped_log_entries_ = 0;
 
   // Exporter calls Stackdriver services to export access logs.
   std::unique_ptr<Exporter> exporter_;
@@ -35,12 +35,11 @@ using google::protobuf::util::TimeUtil;
 
 namespace {
 
+using WriteLogEntriesRequests = std::vector<std::string>;
+
 class MockExporter : public Exporter {
  public:
-  MOCK_METHOD2(exportLogs,
-               void(const std::vector<std::unique_ptr<
-                        const google::logging::v2::WriteLogEntriesRequest>>&,
-                    bool));
+  MOCK_METHOD2(exportLogs, void(const WriteLogEntriesRequests&, bool));
 };
 
 const ::Wasm::Common::FlatNode& nodeInfo(flatbuffers::FlatBufferBuilder& fbb) {
@@ -242,6 +241,13 @@ std::string write_log_request_json = R"({
   ]
 })";
 
+google::logging::v2::WriteLogEntriesRequest parseRequest(
+    const std::string& serialized) {
+  google::logging::v2::WriteLogEntriesRequest req;
+  EXPECT_TRUE(req.ParseFromString(serialized));
+  return req;
+}
+
 google::logging::v2::WriteLogEntriesRequest expectedRequest(
     int log_entry_count, bool for_audit = false) {
   google::logging::v2::WriteLogEntriesRequest req;
@@ -269,14 +275,12 @@ TEST(LoggerTest, TestWriteLogEntry) {
                       false);
   EXPECT_CALL(*exporter_ptr, exportLogs(::testing::_, ::testing::_))
       .WillOnce(::testing::Invoke(
-          [](const std::vector<std::unique_ptr<
-                 const google::logging::v2::WriteLogEntriesRequest>>& requests,
-             bool) {
+          [](const WriteLogEntriesRequests& requests, bool) {
             for (const auto& req : requests) {
               std::string diff;
               MessageDifferencer differ;
               differ.ReportDifferencesToString(&diff);
-              if (!differ.Compare(expectedRequest(1), *req)) {
+              if (!differ.Compare(expectedRequest(1), parseRequest(req))) {
                 FAIL() << "unexpected log entry " << diff << "\n";
               }
             }
@@ -289,8 +293,10 @@ TEST(LoggerTest, TestWriteLogEntryRotation) {
   auto exporter_ptr = exporter.get();
   flatbuffers::FlatBufferBuilder local, peer;
   std::unordered_map<std::string, std::string> extra_labels;
+  // Two entries fill a request exactly.
+  const int size_limit = expectedRequest(2).ByteSizeLong();
   auto logger = std::make_unique<Logger>(nodeInfo(local), std::move(exporter),
-                                         extra_labels, 1200);
+                                         extra_labels, size_limit);
 
   for (int i = 0; i < 10; i++) {
     logger->addLogEntry(requestInfo(), peerNodeInfo(peer), extra_labels, false,
@@ -298,15 +304,14 @@ TEST(LoggerTest, TestWriteLogEntryRotation) {
   }
   EXPECT_CALL(*exporter_ptr, exportLogs(::testing::_, ::testing::_))
       .WillOnce(::testing::Invoke(
-          [](const std::vector<std::unique_ptr<
-                 const google::logging::v2::WriteLogEntriesRequest>>& requests,
-             bool) {
+          [size_limit](const WriteLogEntriesRequests& requests, bool) {
             EXPECT_EQ(requests.size(), 5);
             for (const auto& req : requests) {
+              EXPECT_EQ(req.size(), size_limit);
               std::string diff;
               MessageDifferencer differ;
               differ.ReportDifferencesToString(&diff);
-              if (!differ.Compare(expectedRequest(2), *req)) {
+              if (!differ.Compare(expectedRequest(2), parseRequest(req))) {
                 FAIL() << "unexpected log entry " << diff << "\n";
               }
             }
@@ -314,6 +319,87 @@ TEST(LoggerTest, TestWriteLogEntryRotation) {
   logger->exportLogEntry(/* is_on_done = */ false);
 }
 
+TEST(LoggerTest, TestWriteLogEntryRotationBelowLimit) {
+  auto exporter = std::make_unique<::testing::NiceMock<MockExporter>>();
+  auto exporter_ptr = exporter.get();
+  flatbuffers::FlatBufferBuilder local, peer;
+  std::unordered_map<std::string, std::string> extra_labels;
+  // The third entry of a request would exceed the limit by one byte.
+  const int size_limit = expectedRequest(3).ByteSizeLong() - 1;
+  auto logger = std::make_unique<Logger>(nodeInfo(local), std::move(exporter),
+                                         extra_labels, size_limit);
+
+  for (int i = 0; i < 9; i++) {
+    logger->addLogEntry(requestInfo(), peerNodeInfo(peer), extra_labels, false,
+                        false);
+  }
+  EXPECT_CALL(*exporter_ptr, exportLogs(::testing::_, ::testing::_))
+      .WillOnce(::testing::Invoke(
+          [size_limit](const WriteLogEntriesRequests& requests, bool) {
+            EXPECT_EQ(requests.size(), 5);
+            for (size_t i = 0; i < requests.size(); i++) {
+              EXPECT_LE(requests[i].size(), size_limit);
+              std::string diff;
+              MessageDifferencer differ;
+              differ.ReportDifferencesToString(&diff);
+              if (!differ.Compare(expectedRequest(i < 4 ? 2 : 1),
+                                  parseRequest(requests[i]))) {
+                FAIL() << "unexpected log entry " << diff << "\n";
+              }
+            }
+          }));
+  logger->exportLogEntry(/* is_on_done = */ false);
+}
+
+TEST(LoggerTest, TestDropOversizedLogEntry) {
+  auto exporter = std::make_unique<::testing::NiceMock<MockExporter>>();
+  auto exporter_ptr = exporter.get();
+  flatbuffers::FlatBufferBuilder local, peer;
+  std::unordered_map<std::string, std::string> extra_labels;
+  // A request of a single entry exceeds the limit by one byte.
+  const int size_limit = expectedRequest(1).ByteSizeLong() - 1;
+  auto logger = std::make_unique<Logger>(nodeInfo(local), std::move(exporter),
+                                         extra_labels, size_limit);
+
+  for (int i = 0; i < 3; i++) {
+    logger->addLogEntry(requestInfo(), peerNodeInfo(peer), extra_labels, false,
+                        false);
+  }
+  EXPECT_EQ(logger->droppedLogEntries(), 3);
+  EXPECT_CALL(*exporter_ptr, exportLogs(::testing::_, ::testing::_)).Times(0);
+  EXPECT_FALSE(logger->exportLogEntry(/* is_on_done = */ false));
+}
+
+TEST(LoggerTest, TestWriteLogEntryAfterExport) {
+  auto exporter = std::make_unique<::testing::NiceMock<MockExporter>>();
+  auto exporter_ptr = exporter.get();
+  flatbuffers::FlatBufferBuilder local, peer;
+  std::unordered_map<std::string, std::string> extra_labels;
+  auto logger = std::make_unique<Logger>(nodeInfo(local), std::move(exporter),
+                                         extra_labels);
+  EXPECT_CALL(*exporter_ptr, exportLogs(::testing::_, ::testing::_))
+      .Times(2)
+      .WillRepeatedly(::testing::Invoke(
+          [](const WriteLogEntriesRequests& requests, bool) {
+            EXPECT_EQ(requests.size(), 1);
+            for (const auto& req : requests) {
+              std::string diff;
+              MessageDifferencer differ;
+              differ.ReportDifferencesToString(&diff);
+              if (!differ.Compare(expectedRequest(1), parseRequest(req))) {
+                FAIL() << "unexpected log entry " << diff << "\n";
+              }
+            }
+          }));
+  // Requests started after an export are built on the reset arena.
+  for (int i = 0; i < 2; i++) {
+    logger->addLogEntry(requestInfo(), peerNodeInfo(peer), extra_labels, false,
+                        false);
+    logger->exportLogEntry(/* is_on_done = */ false);
+  }
+  EXPECT_FALSE(logger->exportLogEntry(/* is_on_done = */ false));
+}
+
 TEST(LoggerTest, TestWriteAuditEntry) {
   auto exporter = std::make_unique<::testing::NiceMock<MockExporter>>();
   auto exporter_ptr = exporter.get();
@@ -325,14 +411,13 @@ TEST(LoggerTest, TestWriteAuditEntry) {
                       true);
   EXPECT_CALL(*exporter_ptr, exportLogs(::testing::_, ::testing::_))
       .WillOnce(::testing::Invoke(
-          [](const std::vector<std::unique_ptr<
-                 const google::logging::v2::WriteLogEntriesRequest>>& requests,
-             bool) {
+          [](const WriteLogEntriesRequests& requests, bool) {
             for (const auto& req : requests) {
               std::string diff;
               MessageDifferencer differ;
               differ.ReportDifferencesToString(&diff);
-              if (!differ.Compare(expectedRequest(1, true), *req)) {
+              if (!differ.Compare(expectedRequest(1, true),
+                                  parseRequest(req))) {
                 FAIL() << "unexpected audit entry " << diff << "\n";
               }
             }
@@ -355,9 +440,7 @@ TEST(LoggerTest, TestWriteAuditAndLogEntry) {
   }
   EXPECT_CALL(*exporter_ptr, exportLogs(::testing::_, ::testing::_))
       .WillOnce(::testing::Invoke(
-          [](const std::vector<std::unique_ptr<
-                 const google::logging::v2::WriteLogEntriesRequest>>& requests,
-             bool) {
+          [](const WriteLogEntriesRequests& requests, bool) {
             bool foundAudit = false;
             bool foundLog = false;
             std::string diff;
@@ -365,11 +448,12 @@ TEST(LoggerTest, TestWriteAuditAndLogEntry) {
             for (const auto& req : requests) {
               MessageDifferencer differ;
               differ.ReportDifferencesToString(&diff);
-              if (differ.Compare(expectedRequest(5, true), *req)) {
+              if (differ.Compare(expectedRequest(5, true), parseRequest(req))) {
                 foundAudit = true;
               }
 
-              if (differ.Compare(expectedRequest(5, false), *req)) {
+              if (differ.Compare(expectedRequest(5, false),
+                                 parseRequest(req))) {
                 foundLog = true;
               }
             }
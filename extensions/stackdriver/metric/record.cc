@@ -15,9 +15,14 @@
 
 #include "extensions/stackdriver/metric/record.h"
 
+#include <charconv>
+#include <string_view>
+#include <utility>
+
 #include "extensions/stackdriver/common/constants.h"
 #include "extensions/stackdriver/metric/registry.h"
 #include "google/protobuf/util/time_util.h"
+#include "opencensus/tags/tag_map.h"
 
 using google::protobuf::util::TimeUtil;
 
@@ -25,164 +30,88 @@ namespace Extensions {
 namespace Stackdriver {
 namespace Metric {
 
-using TagKeyValueList =
-    std::vector<std::pair<opencensus::tags::TagKey, std::string>>;
-
 namespace {
 
 using Common::unknownIfEmpty;
 
-std::string getLocalCanonicalName(
-    const ::Wasm::Common::FlatNode& local_node_info) {
-  const auto local_labels = local_node_info.labels();
+std::string getCanonicalName(const ::Wasm::Common::FlatNode& node_info) {
+  const auto labels = node_info.labels();
 
-  const auto local_name_iter =
-      local_labels ? local_labels->LookupByKey(
-                         Wasm::Common::kCanonicalServiceLabelName.data())
-                   : nullptr;
-  const auto local_canonical_name = local_name_iter
-                                        ? local_name_iter->value()
-                                        : local_node_info.workload_name();
-
-  return flatbuffers::GetString(local_canonical_name);
-}
+  const auto name_iter =
+      labels ? labels->LookupByKey(
+                   Wasm::Common::kCanonicalServiceLabelName.data())
+             : nullptr;
+  const auto canonical_name =
+      name_iter ? name_iter->value() : node_info.workload_name();
 
-std::string getLocalCanonicalRev(
-    const ::Wasm::Common::FlatNode& local_node_info) {
-  const auto local_labels = local_node_info.labels();
-
-  const auto local_rev_iter =
-      local_labels
-          ? local_labels->LookupByKey(
-                Wasm::Common::kCanonicalServiceRevisionLabelName.data())
-          : nullptr;
-  const auto local_canonical_rev =
-      local_rev_iter ? local_rev_iter->value() : nullptr;
-  return local_canonical_rev ? local_canonical_rev->str()
-                             : ::Wasm::Common::kLatest.data();
+  return flatbuffers::GetString(canonical_name);
 }
 
-std::string getPeerCanonicalName(
-    const ::Wasm::Common::FlatNode& peer_node_info) {
-  const auto peer_labels = peer_node_info.labels();
+std::string getCanonicalRev(const ::Wasm::Common::FlatNode& node_info) {
+  const auto labels = node_info.labels();
 
-  const auto peer_name_iter =
-      peer_labels ? peer_labels->LookupByKey(
-                        Wasm::Common::kCanonicalServiceLabelName.data())
-                  : nullptr;
-  const auto peer_canonical_name =
-      peer_name_iter ? peer_name_iter->value() : peer_node_info.workload_name();
-
-  return flatbuffers::GetString(peer_canonical_name);
-}
-
-std::string getPeerCanonicalRev(
-    const ::Wasm::Common::FlatNode& peer_node_info) {
-  const auto peer_labels = peer_node_info.labels();
-
-  const auto peer_rev_iter =
-      peer_labels ? peer_labels->LookupByKey(
-                        Wasm::Common::kCanonicalServiceRevisionLabelName.data())
-                  : nullptr;
-  const auto peer_canonical_rev =
-      peer_rev_iter ? peer_rev_iter->value() : nullptr;
-  return peer_canonical_rev ? peer_canonical_rev->str()
-                            : ::Wasm::Common::kLatest.data();
+  const auto rev_iter =
+      labels ? labels->LookupByKey(
+                   Wasm::Common::kCanonicalServiceRevisionLabelName.data())
+             : nullptr;
+  const auto canonical_rev = rev_iter ? rev_iter->value() : nullptr;
+  return canonical_rev ? canonical_rev->str() : ::Wasm::Common::kLatest.data();
 }
 
-TagKeyValueList getOutboundTagMap(
-    const ::Wasm::Common::FlatNode& local_node_info,
-    const ::Wasm::Common::FlatNode& peer_node_info,
-    const ::Wasm::Common::RequestInfo& request_info) {
-  TagKeyValueList outboundMap = {
+// Tags which only depend on the local and the peer node.
+TagKeyValueList getNodeTags(bool is_outbound,
+                            const ::Wasm::Common::FlatNode& local_node_info,
+                            const ::Wasm::Common::FlatNode& peer_node_info) {
+  const auto& source = is_outbound ? local_node_info : peer_node_info;
+  const auto& destination = is_outbound ? peer_node_info : local_node_info;
+  TagKeyValueList node_tags = {
       {meshUIDKey(),
        unknownIfEmpty(flatbuffers::GetString(local_node_info.mesh_id()))},
-      {requestProtocolKey(),
-       unknownIfEmpty(std::string(
-           ::Wasm::Common::ProtocolString(request_info.request_protocol)))},
-      {serviceAuthenticationPolicyKey(),
-       unknownIfEmpty(std::string(::Wasm::Common::AuthenticationPolicyString(
-           request_info.service_auth_policy)))},
-      {destinationServiceNameKey(),
-       unknownIfEmpty(request_info.destination_service_name)},
       {destinationServiceNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(peer_node_info.namespace_()))},
-      {destinationPortKey(),
-       unknownIfEmpty(std::to_string(request_info.destination_port))},
-      {sourcePrincipalKey(), unknownIfEmpty(request_info.source_principal)},
+       unknownIfEmpty(flatbuffers::GetString(destination.namespace_()))},
       {sourceWorkloadNameKey(),
-       unknownIfEmpty(flatbuffers::GetString(local_node_info.workload_name()))},
+       unknownIfEmpty(flatbuffers::GetString(source.workload_name()))},
       {sourceWorkloadNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(local_node_info.namespace_()))},
-      {sourceOwnerKey(), unknownIfEmpty(Common::getOwner(local_node_info))},
-      {destinationPrincipalKey(),
-       unknownIfEmpty(request_info.destination_principal)},
+       unknownIfEmpty(flatbuffers::GetString(source.namespace_()))},
+      {sourceOwnerKey(), unknownIfEmpty(Common::getOwner(source))},
       {destinationWorkloadNameKey(),
-       unknownIfEmpty(flatbuffers::GetString(peer_node_info.workload_name()))},
+       unknownIfEmpty(flatbuffers::GetString(destination.workload_name()))},
       {destinationWorkloadNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(peer_node_info.namespace_()))},
-      {destinationOwnerKey(), unknownIfEmpty(Common::getOwner(peer_node_info))},
+       unknownIfEmpty(flatbuffers::GetString(destination.namespace_()))},
+      {destinationOwnerKey(), unknownIfEmpty(Common::getOwner(destination))},
       {destinationCanonicalServiceNameKey(),
-       unknownIfEmpty(getPeerCanonicalName(peer_node_info))},
+       unknownIfEmpty(getCanonicalName(destination))},
       {destinationCanonicalServiceNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(peer_node_info.namespace_()))},
+       unknownIfEmpty(flatbuffers::GetString(destination.namespace_()))},
       {destinationCanonicalRevisionKey(),
-       unknownIfEmpty(getPeerCanonicalRev(peer_node_info))},
+       unknownIfEmpty(getCanonicalRev(destination))},
       {sourceCanonicalServiceNameKey(),
-       unknownIfEmpty(getLocalCanonicalName(local_node_info))},
+       unknownIfEmpty(getCanonicalName(source))},
       {sourceCanonicalServiceNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(local_node_info.namespace_()))},
-      {sourceCanonicalRevisionKey(),
-       unknownIfEmpty(getLocalCanonicalRev(local_node_info))}};
-  return outboundMap;
+       unknownIfEmpty(flatbuffers::GetString(source.namespace_()))},
+      {sourceCanonicalRevisionKey(), unknownIfEmpty(getCanonicalRev(source))}};
+  return node_tags;
 }
 
-TagKeyValueList getInboundTagMap(
-    const ::Wasm::Common::FlatNode& local_node_info,
-    const ::Wasm::Common::FlatNode& peer_node_info,
-    const ::Wasm::Common::RequestInfo& request_info) {
-  TagKeyValueList inboundMap = {
-      {meshUIDKey(),
-       unknownIfEmpty(flatbuffers::GetString(local_node_info.mesh_id()))},
-      {requestProtocolKey(),
-       unknownIfEmpty(std::string(
-           ::Wasm::Common::ProtocolString(request_info.request_protocol)))},
-      {serviceAuthenticationPolicyKey(),
-       unknownIfEmpty(std::string(::Wasm::Common::AuthenticationPolicyString(
-           request_info.service_auth_policy)))},
-      {destinationServiceNameKey(),
-       unknownIfEmpty(request_info.destination_service_name)},
-      {destinationServiceNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(local_node_info.namespace_()))},
-      {destinationPortKey(),
-       unknownIfEmpty(std::to_string(request_info.destination_port))},
-      {sourcePrincipalKey(), unknownIfEmpty(request_info.source_principal)},
-      {sourceWorkloadNameKey(),
-       unknownIfEmpty(flatbuffers::GetString(peer_node_info.workload_name()))},
-      {sourceWorkloadNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(peer_node_info.namespace_()))},
-      {sourceOwnerKey(), unknownIfEmpty(Common::getOwner(peer_node_info))},
-      {destinationPrincipalKey(),
-       unknownIfEmpty(request_info.destination_principal)},
-      {destinationWorkloadNameKey(),
-       unknownIfEmpty(flatbuffers::GetString(local_node_info.workload_name()))},
-      {destinationWorkloadNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(local_node_info.namespace_()))},
-      {destinationOwnerKey(),
-       unknownIfEmpty(Common::getOwner(local_node_info))},
-      {destinationCanonicalServiceNameKey(),
-       unknownIfEmpty(getLocalCanonicalName(local_node_info))},
-      {destinationCanonicalServiceNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(local_node_info.namespace_()))},
-      {destinationCanonicalRevisionKey(),
-       unknownIfEmpty(getLocalCanonicalRev(local_node_info))},
-      {sourceCanonicalServiceNameKey(),
-       unknownIfEmpty(getPeerCanonicalName(peer_node_info))},
-      {sourceCanonicalServiceNamespaceKey(),
-       unknownIfEmpty(flatbuffers::GetString(peer_node_info.namespace_()))},
-      {sourceCanonicalRevisionKey(),
-       unknownIfEmpty(getPeerCanonicalRev(peer_node_info))}};
-  return inboundMap;
+// Sets the tag at the given position, reusing the string already there.
+void setTag(TagKeyValueList& tags, size_t pos,
+            const opencensus::tags::TagKey& key, std::string_view value) {
+  if (pos < tags.size()) {
+    tags[pos].first = key;
+    tags[pos].second.assign(value.data(), value.size());
+    return;
+  }
+  tags.emplace_back(key, std::string(value));
+}
+
+std::string_view unknownIfEmptyView(std::string_view value) {
+  return value.empty() ? std::string_view(Common::kUnknownLabel) : value;
+}
+
+// Formats an integer tag value into the given buffer.
+std::string_view formatUint(uint64_t value, char (&buffer)[24]) {
+  const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  return std::string_view(buffer, result.ptr - buffer);
 }
 
 // See:
@@ -228,96 +157,223 @@ uint32_t httpCodeFromGrpc(uint32_t grpc_status) {
   }
 }
 
-void addHttpSpecificTags(const ::Wasm::Common::RequestInfo& request_info,
-                         TagKeyValueList& tag_map) {
-  const auto& operation =
-      request_info.request_protocol == ::Wasm::Common::Protocol::GRPC
-          ? request_info.request_url_path
-          : request_info.request_operation;
-  tag_map.emplace_back(Metric::requestOperationKey(), operation);
-
-  const auto& response_code =
-      request_info.request_protocol == ::Wasm::Common::Protocol::GRPC
-          ? httpCodeFromGrpc(request_info.grpc_status)
-          : request_info.response_code;
-  tag_map.emplace_back(Metric::responseCodeKey(),
-                       std::to_string(response_code));
+// Maximum number of measurements passed to a single OpenCensus Record call.
+constexpr size_t kMaxMeasurementsPerRecord = 64;
+
+template <size_t... I>
+void recordChunk(const opencensus::stats::Measurement* measurements,
+                 const opencensus::tags::TagMap& tags,
+                 std::index_sequence<I...>) {
+  opencensus::stats::Record({measurements[I]...}, tags);
+}
+
+// Records the measurements in as few calls as possible. OpenCensus only takes
+// initializer lists, so the measurements are split into chunks of
+// power-of-two sizes.
+template <size_t N>
+void recordMeasurements(const opencensus::stats::Measurement* measurements,
+                        size_t size, const opencensus::tags::TagMap& tags) {
+  for (; size >= N; measurements += N, size -= N) {
+    recordChunk(measurements, tags, std::make_index_sequence<N>());
+  }
+  if constexpr (N > 1) {
+    recordMeasurements<N / 2>(measurements, size, tags);
+  }
+}
+
+// Returns the peer ID the node tags are cached by, which is empty without
+// peer metadata.
+std::string_view tagCacheKey(const ::Wasm::Common::PeerNodeInfo& peer) {
+  return peer.found() ? peer.id() : std::string_view();
+}
+
+void recordOrBatch(
+    MetricBatcher* batcher, const TagKeyValueList& tags,
+    std::initializer_list<opencensus::stats::Measurement> measurements) {
+  if (batcher != nullptr) {
+    batcher->add(tags, measurements);
+    return;
+  }
+  opencensus::stats::Record(measurements, tags);
 }
 
 }  // namespace
 
+void MetricBatcher::add(
+    const TagKeyValueList& tags,
+    std::initializer_list<opencensus::stats::Measurement> measurements) {
+  key_.clear();
+  for (const auto& tag : tags) {
+    key_.append(tag.second);
+    key_.push_back('\0');
+  }
+  auto iter = entries_.find(key_);
+  if (iter == entries_.end()) {
+    if (entries_.size() >= kMaxBatchedTagSets) {
+      flush();
+    }
+    iter = entries_.emplace(key_, Entry{tags, {}}).first;
+  }
+  auto& entry = iter->second;
+  entry.measurements.insert(entry.measurements.end(), measurements);
+  pending_ += measurements.size();
+  if (pending_ >= kMaxBatchedMeasurements) {
+    flush();
+  } else if (entry.measurements.size() >= kMaxPendingMeasurements) {
+    record(entry);
+  }
+}
+
+void MetricBatcher::flush() {
+  for (auto& entry : entries_) {
+    record(entry.second);
+  }
+  entries_.clear();
+}
+
+void MetricBatcher::record(Entry& entry) {
+  if (entry.measurements.empty()) {
+    return;
+  }
+  const opencensus::tags::TagMap tags(entry.tags);
+  recordMeasurements<kMaxMeasurementsPerRecord>(
+      entry.measurements.data(), entry.measurements.size(), tags);
+  pending_ -= entry.measurements.size();
+  entry.measurements.clear();
+}
+
+const TagKeyValueList& TagCache::tags(
+    bool is_outbound, const ::Wasm::Common::FlatNode& local_node_info,
+    std::string_view peer_id, const ::Wasm::Common::FlatNode& peer_node_info,
+    const ::Wasm::Common::RequestInfo& request_info, bool http) {
+  const TagKeyValueList* node_tags = &fallback_tags_;
+  if (!peer_id.empty()) {
+    peer_id_.assign(peer_id.data(), peer_id.size());
+    auto iter = peer_tags_.find(peer_id_);
+    if (iter != peer_tags_.end()) {
+      lru_.splice(lru_.begin(), lru_, iter->second.lru);
+    } else {
+      iter = peer_tags_.try_emplace(peer_id_).first;
+      iter->second.tags =
+          getNodeTags(is_outbound, local_node_info, peer_node_info);
+      iter->second.lru = lru_.insert(lru_.begin(), &iter->first);
+      while (peer_tags_.size() > max_size_ && peer_tags_.size() > 1) {
+        auto oldest = peer_tags_.find(*lru_.back());
+        lru_.pop_back();
+        peer_tags_.erase(oldest);
+      }
+    }
+    node_tags = &iter->second.tags;
+  } else {
+    fallback_tags_ = getNodeTags(is_outbound, local_node_info, peer_node_info);
+  }
+
+  size_t pos = 0;
+  for (const auto& tag : *node_tags) {
+    setTag(request_tags_, pos++, tag.first, tag.second);
+  }
+
+  char buffer[24];
+  setTag(request_tags_, pos++, requestProtocolKey(),
+         unknownIfEmptyView(
+             ::Wasm::Common::ProtocolString(request_info.request_protocol)));
+  setTag(request_tags_, pos++, serviceAuthenticationPolicyKey(),
+         unknownIfEmptyView(::Wasm::Common::AuthenticationPolicyString(
+             request_info.service_auth_policy)));
+  setTag(request_tags_, pos++, destinationServiceNameKey(),
+         unknownIfEmpty(request_info.destination_service_name));
+  setTag(request_tags_, pos++, destinationPortKey(),
+         formatUint(request_info.destination_port, buffer));
+  setTag(request_tags_, pos++, sourcePrincipalKey(),
+         unknownIfEmpty(request_info.source_principal));
+  setTag(request_tags_, pos++, destinationPrincipalKey(),
+         unknownIfEmpty(request_info.destination_principal));
+
+  if (http) {
+    const bool grpc =
+        request_info.request_protocol == ::Wasm::Common::Protocol::GRPC;
+    setTag(request_tags_, pos++, requestOperationKey(),
+           grpc ? request_info.request_url_path
+                : request_info.request_operation);
+    setTag(request_tags_, pos++, responseCodeKey(),
+           formatUint(grpc ? httpCodeFromGrpc(request_info.grpc_status)
+                           : request_info.response_code,
+                      buffer));
+  }
+
+  request_tags_.resize(pos);
+  return request_tags_;
+}
+
 void record(bool is_outbound, const ::Wasm::Common::FlatNode& local_node_info,
-            const ::Wasm::Common::FlatNode& peer_node_info,
+            const ::Wasm::Common::PeerNodeInfo& peer_node_info,
             const ::Wasm::Common::RequestInfo& request_info,
-            bool record_http_size_metrics) {
+            bool record_http_size_metrics, TagCache& tag_cache,
+            MetricBatcher* batcher) {
   double latency_ms = request_info.duration /* in nanoseconds */ / 1000000.0;
+  const TagKeyValueList& tagMap =
+      tag_cache.tags(is_outbound, local_node_info, tagCacheKey(peer_node_info),
+                     peer_node_info.get(), request_info, true /* http */);
   if (is_outbound) {
-    TagKeyValueList tagMap =
-        getOutboundTagMap(local_node_info, peer_node_info, request_info);
-    addHttpSpecificTags(request_info, tagMap);
     if (record_http_size_metrics) {
-      opencensus::stats::Record(
+      recordOrBatch(
+          batcher, tagMap,
           {{clientRequestCountMeasure(), 1},
            {clientRoundtripLatenciesMeasure(), latency_ms},
            {clientRequestBytesMeasure(), request_info.request_size},
-           {clientResponseBytesMeasure(), request_info.response_size}},
-          tagMap);
+           {clientResponseBytesMeasure(), request_info.response_size}});
     } else {
-      opencensus::stats::Record(
-          {{clientRequestCountMeasure(), 1},
-           {clientRoundtripLatenciesMeasure(), latency_ms}},
-          tagMap);
+      recordOrBatch(batcher, tagMap,
+                    {{clientRequestCountMeasure(), 1},
+                     {clientRoundtripLatenciesMeasure(), latency_ms}});
     }
 
     return;
   }
 
-  TagKeyValueList tagMap =
-      getInboundTagMap(local_node_info, peer_node_info, request_info);
-  addHttpSpecificTags(request_info, tagMap);
   if (record_http_size_metrics) {
-    opencensus::stats::Record(
+    recordOrBatch(
+        batcher, tagMap,
         {{serverRequestCountMeasure(), 1},
          {serverResponseLatenciesMeasure(), latency_ms},
          {serverRequestBytesMeasure(), request_info.request_size},
-         {serverResponseBytesMeasure(), request_info.response_size}},
-        tagMap);
+         {serverResponseBytesMeasure(), request_info.response_size}});
   } else {
-    opencensus::stats::Record({{serverRequestCountMeasure(), 1},
-                               {serverResponseLatenciesMeasure(), latency_ms}},
-                              tagMap);
+    recordOrBatch(batcher, tagMap,
+                  {{serverRequestCountMeasure(), 1},
+                   {serverResponseLatenciesMeasure(), latency_ms}});
   }
 }
 
 void recordTCP(bool is_outbound,
                const ::Wasm::Common::FlatNode& local_node_info,
-               const ::Wasm::Common::FlatNode& peer_node_info,
-               const ::Wasm::Common::RequestInfo& request_info) {
+               const ::Wasm::Common::PeerNodeInfo& peer_node_info,
+               const ::Wasm::Common::RequestInfo& request_info,
+               TagCache& tag_cache, MetricBatcher* batcher) {
+  const TagKeyValueList& tagMap =
+      tag_cache.tags(is_outbound, local_node_info, tagCacheKey(peer_node_info),
+                     peer_node_info.get(), request_info, false /* http */);
   if (is_outbound) {
-    TagKeyValueList tagMap =
-        getOutboundTagMap(local_node_info, peer_node_info, request_info);
-    opencensus::stats::Record(
+    recordOrBatch(
+        batcher, tagMap,
         {{clientConnectionsOpenCountMeasure(),
           request_info.tcp_connections_opened},
          {clientConnectionsCloseCountMeasure(),
           request_info.tcp_connections_closed},
          {clientReceivedBytesCountMeasure(), request_info.tcp_received_bytes},
-         {clientSentBytesCountMeasure(), request_info.tcp_sent_bytes}},
-        tagMap);
+         {clientSentBytesCountMeasure(), request_info.tcp_sent_bytes}});
 
     return;
   }
 
-  TagKeyValueList tagMap =
-      getInboundTagMap(local_node_info, peer_node_info, request_info);
-  opencensus::stats::Record(
+  recordOrBatch(
+      batcher, tagMap,
       {{serverConnectionsOpenCountMeasure(),
         request_info.tcp_connections_opened},
        {serverConnectionsCloseCountMeasure(),
         request_info.tcp_connections_closed},
        {serverReceivedBytesCountMeasure(), request_info.tcp_received_bytes},
-       {serverSentBytesCountMeasure(), request_info.tcp_sent_bytes}},
-      tagMap);
+       {serverSentBytesCountMeasure(), request_info.tcp_sent_bytes}});
 }
 
 }  // namespace Metric
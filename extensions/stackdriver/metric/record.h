@@ -15,26 +15,136 @@
 
 #pragma once
 
+#include <initializer_list>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
 #include "extensions/common/context.h"
 #include "extensions/stackdriver/config/v1alpha1/stackdriver_plugin_config.pb.h"
+#include "opencensus/stats/stats.h"
+#include "opencensus/tags/tag_key.h"
 
 namespace Extensions {
 namespace Stackdriver {
 namespace Metric {
 
+using TagKeyValueList =
+    std::vector<std::pair<opencensus::tags::TagKey, std::string>>;
+
+// Maximum number of peers whose tags are kept by a TagCache.
+constexpr size_t kMaxTagCacheSize = 500;
+
+// TagCache keeps the metric tags derived from the local and the peer node,
+// which are the same for every request between the two, so that only the
+// request-level tags are filled in per request. Tags are cached by peer ID for
+// peers with exchanged metadata, and the least recently used peer is evicted
+// beyond the maximum size. A cache serves a single traffic direction. Not
+// thread-safe, one is used per root context.
+class TagCache {
+ public:
+  explicit TagCache(size_t max_size = kMaxTagCacheSize)
+      : max_size_(max_size) {}
+
+  // Returns the tags of a request, which stay valid until the next call. The
+  // peer ID is empty if the peer metadata was not found, in which case the
+  // node tags are not cached.
+  const TagKeyValueList& tags(bool is_outbound,
+                              const ::Wasm::Common::FlatNode& local_node_info,
+                              std::string_view peer_id,
+                              const ::Wasm::Common::FlatNode& peer_node_info,
+                              const ::Wasm::Common::RequestInfo& request_info,
+                              bool http);
+
+  // Drops the cached tags, which must be done when the local node changes.
+  void clear() {
+    peer_tags_.clear();
+    lru_.clear();
+  }
+
+  size_t size() const { return peer_tags_.size(); }
+
+ private:
+  struct Entry {
+    TagKeyValueList tags;
+    // Position in the recency list, which points back at the map key.
+    std::list<const std::string*>::iterator lru;
+  };
+
+  // Node-based map so that the key addresses in lru_ stay valid.
+  std::unordered_map<std::string, Entry> peer_tags_;
+  // Most recently used first.
+  std::list<const std::string*> lru_;
+  const size_t max_size_;
+  // Lookup key for peer_tags_, which has no heterogeneous lookup.
+  std::string peer_id_;
+  // Node tags of the last request without peer metadata.
+  TagKeyValueList fallback_tags_;
+  // Reused between requests, so that the tag strings keep their capacity.
+  TagKeyValueList request_tags_;
+};
+
+// Maximum number of measurements kept for a tag set by a MetricBatcher
+// before they are recorded without waiting for the next flush.
+constexpr size_t kMaxPendingMeasurements = 1024;
+// Maximum number of tag sets kept by a MetricBatcher, beyond which all the
+// pending measurements are recorded without waiting for the next flush.
+constexpr size_t kMaxBatchedTagSets = 1000;
+// Maximum number of measurements kept by a MetricBatcher for all the tag
+// sets, beyond which all of them are recorded without waiting for the next
+// flush.
+constexpr size_t kMaxBatchedMeasurements = 16384;
+
+// MetricBatcher keeps the measurements of a worker by interned tag set and
+// records them to OpenCensus on flush(), so that the tag map of a tag set is
+// built once per batch rather than once per request. Every measurement is
+// still recorded, since the count and distribution views need each value.
+// Not thread-safe, one is used per root context.
+class MetricBatcher {
+ public:
+  ~MetricBatcher() { flush(); }
+
+  void add(const TagKeyValueList& tags,
+           std::initializer_list<opencensus::stats::Measurement> measurements);
+
+  // Records all the pending measurements.
+  void flush();
+
+ private:
+  struct Entry {
+    TagKeyValueList tags;
+    std::vector<opencensus::stats::Measurement> measurements;
+  };
+
+  void record(Entry& entry);
+
+  absl::flat_hash_map<std::string, Entry> entries_;
+  // Number of measurements in all the entries.
+  size_t pending_ = 0;
+  // Reused between calls to intern the tag set.
+  std::string key_;
+};
+
 // Record metrics based on local node info and request info.
-// Reporter kind deceides the type of metrics to record.
+// Reporter kind deceides the type of metrics to record. Measurements are
+// recorded directly unless a batcher is given.
 void record(bool is_outbound, const ::Wasm::Common::FlatNode& local_node_info,
-            const ::Wasm::Common::FlatNode& peer_node_info,
+            const ::Wasm::Common::PeerNodeInfo& peer_node_info,
             const ::Wasm::Common::RequestInfo& request_info,
-            bool record_http_size_metrics);
+            bool record_http_size_metrics, TagCache& tag_cache,
+            MetricBatcher* batcher);
 
 // Record TCP metrics based on local node info and request info.
 // Reporter kind deceides the type of metrics to record.
 void recordTCP(bool is_outbound,
                const ::Wasm::Common::FlatNode& local_node_info,
-               const ::Wasm::Common::FlatNode& peer_node_info,
-               const ::Wasm::Common::RequestInfo& request_info);
+               const ::Wasm::Common::PeerNodeInfo& peer_node_info,
+               const ::Wasm::Common::RequestInfo& request_info,
+               TagCache& tag_cache, MetricBatcher* batcher);
 
 }  // namespace Metric
 }  // namespace Stackdriver
@@ -0,0 +1,383 @@
+/* Copyright 2020 Istio Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extensions/stackdriver/metric/record.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "extensions/common/node_info_generated.h"
+#include "gtest/gtest.h"
+#include "opencensus/stats/testing/test_utils.h"
+
+namespace Extensions {
+namespace Stackdriver {
+namespace Metric {
+
+constexpr char kTestMeasure[] = "test/batched";
+constexpr char kTestSumMeasure[] = "test/batched_sum";
+
+opencensus::stats::MeasureInt64 testMeasure() {
+  static const opencensus::stats::MeasureInt64 measure =
+      opencensus::stats::MeasureInt64::Register(kTestMeasure, "", "1");
+  return measure;
+}
+
+opencensus::stats::MeasureDouble testSumMeasure() {
+  static const opencensus::stats::MeasureDouble measure =
+      opencensus::stats::MeasureDouble::Register(kTestSumMeasure, "", "1");
+  return measure;
+}
+
+opencensus::tags::TagKey testTagKey() {
+  static const opencensus::tags::TagKey key =
+      opencensus::tags::TagKey::Register("test_tag");
+  return key;
+}
+
+class MetricBatcherTest : public testing::Test {
+ protected:
+  // Returns the number of measurements recorded since the test started.
+  size_t recorded() {
+    opencensus::stats::testing::TestUtils::Flush();
+    size_t count = 0;
+    for (const auto& row : view_.GetData().int_data()) {
+      count += row.second;
+    }
+    return count;
+  }
+
+  void add(MetricBatcher& batcher, size_t tag_set) {
+    batcher.add({{testTagKey(), std::to_string(tag_set)}}, {{measure_, 1}});
+  }
+
+  void addValue(MetricBatcher& batcher, size_t tag_set, double value) {
+    batcher.add({{testTagKey(), std::to_string(tag_set)}},
+                {{sum_measure_, value}});
+  }
+
+  // Returns the sum of the values recorded for a tag set since the test
+  // started.
+  double recordedSum(size_t tag_set) {
+    opencensus::stats::testing::TestUtils::Flush();
+    const auto& data = sum_view_.GetData().double_data();
+    auto it = data.find({std::to_string(tag_set)});
+    return it == data.end() ? 0 : it->second;
+  }
+
+  // The measures are registered before the views are created.
+  opencensus::stats::MeasureInt64 measure_ = testMeasure();
+  opencensus::stats::MeasureDouble sum_measure_ = testSumMeasure();
+  opencensus::stats::View view_{
+      opencensus::stats::ViewDescriptor()
+          .set_name("test/batched_count")
+          .set_measure(kTestMeasure)
+          .set_aggregation(opencensus::stats::Aggregation::Count())
+          .add_column(testTagKey())};
+  opencensus::stats::View sum_view_{
+      opencensus::stats::ViewDescriptor()
+          .set_name("test/batched_sum")
+          .set_measure(kTestSumMeasure)
+          .set_aggregation(opencensus::stats::Aggregation::Sum())
+          .add_column(testTagKey())};
+};
+
+TEST_F(MetricBatcherTest, RecordsOnFlush) {
+  MetricBatcher batcher;
+  add(batcher, 0);
+  add(batcher, 0);
+  add(batcher, 1);
+  EXPECT_EQ(recorded(), 0u);
+  batcher.flush();
+  EXPECT_EQ(recorded(), 3u);
+  batcher.flush();
+  EXPECT_EQ(recorded(), 3u);
+}
+
+TEST_F(MetricBatcherTest, RecordsFullTagSetEarly) {
+  MetricBatcher batcher;
+  for (size_t i = 0; i < kMaxPendingMeasurements - 1; i++) {
+    add(batcher, 0);
+  }
+  EXPECT_EQ(recorded(), 0u);
+  add(batcher, 0);
+  EXPECT_EQ(recorded(), kMaxPendingMeasurements);
+}
+
+TEST_F(MetricBatcherTest, FlushesBeyondMaxTagSets) {
+  MetricBatcher batcher;
+  for (size_t i = 0; i < kMaxBatchedTagSets; i++) {
+    add(batcher, i);
+  }
+  EXPECT_EQ(recorded(), 0u);
+  // A new tag set beyond the limit flushes the pending ones first.
+  add(batcher, kMaxBatchedTagSets);
+  EXPECT_EQ(recorded(), kMaxBatchedTagSets);
+  // Known tag sets are kept without flushing.
+  add(batcher, kMaxBatchedTagSets);
+  EXPECT_EQ(recorded(), kMaxBatchedTagSets);
+  batcher.flush();
+  EXPECT_EQ(recorded(), kMaxBatchedTagSets + 2);
+}
+
+TEST_F(MetricBatcherTest, FlushesBeyondMaxBatchedMeasurements) {
+  MetricBatcher batcher;
+  // Tag sets stay below their own limit.
+  constexpr size_t tag_sets =
+      2 * kMaxBatchedMeasurements / kMaxPendingMeasurements;
+  for (size_t i = 0; i < kMaxBatchedMeasurements - 1; i++) {
+    add(batcher, i % tag_sets);
+  }
+  EXPECT_EQ(recorded(), 0u);
+  add(batcher, 0);
+  EXPECT_EQ(recorded(), kMaxBatchedMeasurements);
+}
+
+// Batched values are recorded as they are, and sum up per tag set.
+TEST_F(MetricBatcherTest, RecordsBatchedValues) {
+  MetricBatcher batcher;
+  addValue(batcher, 0, 1.5);
+  addValue(batcher, 1, 4);
+  addValue(batcher, 0, 2.5);
+  EXPECT_DOUBLE_EQ(recordedSum(0), 0);
+  batcher.flush();
+  EXPECT_DOUBLE_EQ(recordedSum(0), 4);
+  EXPECT_DOUBLE_EQ(recordedSum(1), 4);
+  addValue(batcher, 1, 0.25);
+  batcher.flush();
+  EXPECT_DOUBLE_EQ(recordedSum(0), 4);
+  EXPECT_DOUBLE_EQ(recordedSum(1), 4.25);
+}
+
+TEST_F(MetricBatcherTest, FlushesOnDestruction) {
+  {
+    MetricBatcher batcher;
+    add(batcher, 0);
+    add(batcher, 1);
+    EXPECT_EQ(recorded(), 0u);
+  }
+  EXPECT_EQ(recorded(), 2u);
+}
+
+// Returns a serialized FlatNode. Canonical labels are only set if non-empty.
+std::string flatNode(std::string_view workload, std::string_view namespace_,
+                     std::string_view owner = "",
+                     std::string_view canonical_service = "",
+                     std::string_view canonical_revision = "") {
+  flatbuffers::FlatBufferBuilder fbb;
+  auto workload_offset = fbb.CreateString(workload);
+  auto namespace_offset = fbb.CreateString(namespace_);
+  auto mesh_id_offset = fbb.CreateString("mesh");
+  flatbuffers::Offset<flatbuffers::String> owner_offset;
+  if (!owner.empty()) {
+    owner_offset = fbb.CreateString(owner);
+  }
+  std::vector<flatbuffers::Offset<::Wasm::Common::KeyVal>> labels;
+  if (!canonical_service.empty()) {
+    labels.push_back(::Wasm::Common::CreateKeyVal(
+        fbb,
+        fbb.CreateString(::Wasm::Common::kCanonicalServiceLabelName.data()),
+        fbb.CreateString(canonical_service)));
+  }
+  if (!canonical_revision.empty()) {
+    labels.push_back(::Wasm::Common::CreateKeyVal(
+        fbb,
+        fbb.CreateString(
+            ::Wasm::Common::kCanonicalServiceRevisionLabelName.data()),
+        fbb.CreateString(canonical_revision)));
+  }
+  auto labels_offset = fbb.CreateVectorOfSortedTables(&labels);
+  ::Wasm::Common::FlatNodeBuilder node(fbb);
+  if (!workload.empty()) {
+    node.add_workload_name(workload_offset);
+  }
+  if (!namespace_.empty()) {
+    node.add_namespace_(namespace_offset);
+  }
+  node.add_mesh_id(mesh_id_offset);
+  if (!owner.empty()) {
+    node.add_owner(owner_offset);
+  }
+  node.add_labels(labels_offset);
+  fbb.Finish(node.Finish());
+  return std::string(reinterpret_cast<const char*>(fbb.GetBufferPointer()),
+                     fbb.GetSize());
+}
+
+const ::Wasm::Common::FlatNode& asNode(const std::string& buffer) {
+  return *flatbuffers::GetRoot<::Wasm::Common::FlatNode>(buffer.data());
+}
+
+std::map<std::string, std::string> byName(const TagKeyValueList& tags) {
+  std::map<std::string, std::string> result;
+  for (const auto& tag : tags) {
+    EXPECT_TRUE(result.emplace(tag.first.name(), tag.second).second)
+        << "duplicate tag " << tag.first.name();
+  }
+  return result;
+}
+
+// Node-derived tag values of one side of a request.
+struct NodeTags {
+  std::string workload;
+  std::string namespace_;
+  std::string owner;
+  std::string canonical_service;
+  std::string canonical_revision;
+};
+
+class TagCacheTest : public testing::Test {
+ protected:
+  TagCacheTest() {
+    request_info_.request_protocol = ::Wasm::Common::Protocol::HTTP;
+    request_info_.service_auth_policy =
+        ::Wasm::Common::ServiceAuthenticationPolicy::MutualTLS;
+    request_info_.destination_service_name = "svc";
+    request_info_.destination_port = 9080;
+    request_info_.source_principal = "source-principal";
+    request_info_.request_operation = "GET";
+    request_info_.response_code = 200;
+  }
+
+  // Returns the tags the per-request tag maps were built with before the
+  // cache, for the request info of the fixture.
+  std::map<std::string, std::string> expectedTags(const NodeTags& source,
+                                                  const NodeTags& destination,
+                                                  bool http) {
+    std::map<std::string, std::string> tags = {
+        {"mesh_uid", "mesh"},
+        {"request_protocol", "http"},
+        {"service_authentication_policy", "MUTUAL_TLS"},
+        {"destination_service_name", "svc"},
+        {"destination_service_namespace", destination.namespace_},
+        {"destination_port", "9080"},
+        {"source_principal", "source-principal"},
+        {"source_workload_name", source.workload},
+        {"source_workload_namespace", source.namespace_},
+        {"source_owner", source.owner},
+        {"destination_principal", "unknown"},
+        {"destination_workload_name", destination.workload},
+        {"destination_workload_namespace", destination.namespace_},
+        {"destination_owner", destination.owner},
+        {"destination_canonical_service_name", destination.canonical_service},
+        {"destination_canonical_service_namespace", destination.namespace_},
+        {"destination_canonical_revision", destination.canonical_revision},
+        {"source_canonical_service_name", source.canonical_service},
+        {"source_canonical_service_namespace", source.namespace_},
+        {"source_canonical_revision", source.canonical_revision}};
+    if (http) {
+      tags["request_operation"] = "GET";
+      tags["response_code"] = "200";
+    }
+    return tags;
+  }
+
+  const std::string local_ = flatNode("local-workload", "local-ns",
+                                      "local-owner", "local-svc", "v2");
+  const std::string peer_ = flatNode("peer-workload", "peer-ns");
+  const std::string other_peer_ = flatNode("other-workload", "peer-ns");
+  // Fallback node of a peer without metadata.
+  const std::string missing_peer_ = flatNode("", "");
+  const NodeTags local_tags_{"local-workload", "local-ns", "local-owner",
+                             "local-svc", "v2"};
+  const NodeTags peer_tags_{"peer-workload", "peer-ns", "unknown",
+                            "peer-workload", "latest"};
+  const NodeTags missing_peer_tags_{"unknown", "unknown", "unknown",
+                                    "unknown", "latest"};
+  ::Wasm::Common::RequestInfo request_info_;
+};
+
+TEST_F(TagCacheTest, MatchesRequestTagMaps) {
+  // A cache only serves one direction, like the root context using it.
+  for (bool http : {true, false}) {
+    TagCache outbound;
+    EXPECT_EQ(byName(outbound.tags(true, asNode(local_), "peer", asNode(peer_),
+                                   request_info_, http)),
+              expectedTags(local_tags_, peer_tags_, http));
+    // Missing peers are not cached.
+    EXPECT_EQ(byName(outbound.tags(true, asNode(local_), "",
+                                   asNode(missing_peer_), request_info_, http)),
+              expectedTags(local_tags_, missing_peer_tags_, http));
+    EXPECT_EQ(outbound.size(), 1);
+
+    TagCache inbound;
+    EXPECT_EQ(byName(inbound.tags(false, asNode(local_), "peer", asNode(peer_),
+                                  request_info_, http)),
+              expectedTags(peer_tags_, local_tags_, http));
+    EXPECT_EQ(byName(inbound.tags(false, asNode(local_), "",
+                                  asNode(missing_peer_), request_info_, http)),
+              expectedTags(missing_peer_tags_, local_tags_, http));
+    EXPECT_EQ(inbound.size(), 1);
+  }
+}
+
+TEST_F(TagCacheTest, ReusesNodeTagsOfPeer) {
+  TagCache cache;
+  auto tags = byName(cache.tags(true, asNode(local_), "peer", asNode(peer_),
+                                request_info_, true));
+  EXPECT_EQ(tags["destination_workload_name"], "peer-workload");
+  EXPECT_EQ(tags["response_code"], "200");
+
+  // The node tags of a known peer ID are not derived again, while the
+  // request-level tags follow the request.
+  request_info_.request_operation = "POST";
+  request_info_.response_code = 503;
+  request_info_.destination_port = 8080;
+  tags = byName(cache.tags(true, asNode(local_), "peer", asNode(other_peer_),
+                           request_info_, true));
+  EXPECT_EQ(tags["destination_workload_name"], "peer-workload");
+  EXPECT_EQ(tags["request_operation"], "POST");
+  EXPECT_EQ(tags["response_code"], "503");
+  EXPECT_EQ(tags["destination_port"], "8080");
+  EXPECT_EQ(cache.size(), 1);
+
+  // gRPC requests report the path and the status mapped to an HTTP code.
+  request_info_.request_protocol = ::Wasm::Common::Protocol::GRPC;
+  request_info_.request_url_path = "/svc.Service/Method";
+  request_info_.grpc_status = 5;
+  tags = byName(cache.tags(true, asNode(local_), "peer", asNode(peer_),
+                           request_info_, true));
+  EXPECT_EQ(tags["request_protocol"], "grpc");
+  EXPECT_EQ(tags["request_operation"], "/svc.Service/Method");
+  EXPECT_EQ(tags["response_code"], "404");
+}
+
+TEST_F(TagCacheTest, EvictsLeastRecentlyUsedPeer) {
+  TagCache cache(2);
+  auto workload = [&](std::string_view peer_id, const std::string& node) {
+    return byName(cache.tags(true, asNode(local_), peer_id, asNode(node),
+                             request_info_,
+                             true))["destination_workload_name"];
+  };
+  EXPECT_EQ(workload("a", peer_), "peer-workload");
+  EXPECT_EQ(workload("b", peer_), "peer-workload");
+  // Touch the oldest peer so that the other one is evicted next.
+  EXPECT_EQ(workload("a", other_peer_), "peer-workload");
+  EXPECT_EQ(workload("c", peer_), "peer-workload");
+  EXPECT_EQ(cache.size(), 2);
+
+  // Cached peers keep their tags, and evicted ones are derived again.
+  EXPECT_EQ(workload("a", other_peer_), "peer-workload");
+  EXPECT_EQ(workload("c", other_peer_), "peer-workload");
+  EXPECT_EQ(workload("b", other_peer_), "other-workload");
+  EXPECT_EQ(cache.size(), 2);
+  // "a" was the least recently used peer.
+  EXPECT_EQ(workload("a", other_peer_), "other-workload");
+}
+
+}  // namespace Metric
+}  // namespace Stackdriver
+}  // namespace Extensions
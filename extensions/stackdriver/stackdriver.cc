@@ -238,6 +238,15 @@ bool StackdriverRootContext::configure(size_t configuration_size) {
     return false;
   }
   local_node_info_ = getLocalNodeMetadata();
+  tag_cache_.clear();
+  if (config_.enable_metric_aggregation()) {
+    if (!metric_batcher_) {
+      metric_batcher_ =
+          std::make_unique<::Extensions::Stackdriver::Metric::MetricBatcher>();
+    }
+  } else {
+    metric_batcher_.reset();
+  }
 
   if (config_.has_log_report_duration()) {
     log_report_duration_nanos_ =
@@ -256,6 +265,17 @@ bool StackdriverRootContext::configure(size_t configuration_size) {
 
   direction_ = ::Wasm::Common::getTrafficDirection();
   use_host_header_fallback_ = !config_.disable_host_header_fallback();
+  // Response flags are only logged, and sizes are only needed by the size
+  // metrics and the logs.
+  request_fields_ = ::Wasm::Common::kAllRequestFields;
+  if (!enableAccessLog()) {
+    request_fields_ &=
+        ~static_cast<uint32_t>(::Wasm::Common::RequestField::ResponseFlag);
+    if (config_.disable_http_size_metrics() && !enableAuditLog()) {
+      request_fields_ &=
+          ~static_cast<uint32_t>(::Wasm::Common::RequestField::Sizes);
+    }
+  }
   const ::Wasm::Common::FlatNode& local_node =
       *flatbuffers::GetRoot<::Wasm::Common::FlatNode>(local_node_info_.data());
 
@@ -410,10 +430,20 @@ void StackdriverRootContext::onTick() {
     }
   }
 
+  if (metric_batcher_) {
+    metric_batcher_->flush();
+  }
+
   if (enableAccessLog() &&
       (cur - last_log_report_call_nanos_ > log_report_duration_nanos_)) {
     logger_->exportLogEntry(/* is_on_done= */ false);
     last_log_report_call_nanos_ = cur;
+    if (logger_->droppedLogEntries() != dropped_log_entries_) {
+      logWarn(absl::StrCat(
+          "Dropped ", logger_->droppedLogEntries() - dropped_log_entries_,
+          " access log entries larger than the log request size limit"));
+      dropped_log_entries_ = logger_->droppedLogEntries();
+    }
   }
 }
 
@@ -436,6 +466,9 @@ bool StackdriverRootContext::onDone() {
     recordTCP(item.first);
   }
   tcp_request_queue_.clear();
+  if (metric_batcher_) {
+    metric_batcher_->flush();
+  }
   cleanupExpressions();
   return done;
 }
@@ -449,10 +482,10 @@ void StackdriverRootContext::record() {
 
   ::Wasm::Common::RequestInfo request_info;
   ::Wasm::Common::populateHTTPRequestInfo(outbound, useHostHeaderFallback(),
-                                          &request_info);
+                                          &request_info, request_fields_);
   ::Extensions::Stackdriver::Metric::record(
-      outbound, local_node, peer_node_info.get(), request_info,
-      !config_.disable_http_size_metrics());
+      outbound, local_node, peer_node_info, request_info,
+      !config_.disable_http_size_metrics(), tag_cache_, metric_batcher_.get());
   bool extended_info_populated = false;
   if ((enableAllAccessLog() ||
        (enableAccessLogOnError() &&
@@ -489,9 +522,6 @@ void StackdriverRootContext::record() {
 
 bool StackdriverRootContext::recordTCP(uint32_t id) {
   const bool outbound = isOutbound();
-  Wasm::Common::PeerNodeInfo peer_node_info(
-      {outbound ? kUpstreamMetadataIdKey : kDownstreamMetadataIdKey},
-      {outbound ? kUpstreamMetadataKey : kDownstreamMetadataKey});
   const ::Wasm::Common::FlatNode& local_node = getLocalNode();
 
   auto req_iter = tcp_request_queue_.find(id);
@@ -500,6 +530,12 @@ bool StackdriverRootContext::recordTCP(uint32_t id) {
   }
   StackdriverRootContext::TcpRecordInfo& record_info = *(req_iter->second);
   ::Wasm::Common::RequestInfo& request_info = *(record_info.request_info);
+  if (!record_info.peer_node_info || !record_info.peer_node_info->found()) {
+    record_info.peer_node_info.emplace(
+        outbound ? kUpstreamMetadataIdKey : kDownstreamMetadataIdKey,
+        outbound ? kUpstreamMetadataKey : kDownstreamMetadataKey);
+  }
+  const auto& peer_node_info = *record_info.peer_node_info;
 
   // For TCP, if peer metadata is not available, peer id is set as not found.
   // Otherwise, we wait for metadata exchange to happen before we report  any
@@ -519,11 +555,13 @@ bool StackdriverRootContext::recordTCP(uint32_t id) {
     return false;
   }
   if (!request_info.is_populated) {
-    ::Wasm::Common::populateTCPRequestInfo(outbound, &request_info);
+    ::Wasm::Common::populateTCPRequestInfo(outbound, &request_info,
+                                           request_fields_);
   }
   // Record TCP Metrics.
   ::Extensions::Stackdriver::Metric::recordTCP(
-      outbound, local_node, peer_node_info.get(), request_info);
+      outbound, local_node, peer_node_info, request_info, tag_cache_,
+      metric_batcher_.get());
   bool extended_info_populated = false;
   // Add LogEntry to Logger. Log Entries are batched and sent on timer
   // to Stackdriver Logging Service.
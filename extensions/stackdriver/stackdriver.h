@@ -15,6 +15,8 @@
 
 #pragma once
 
+#include <optional>
+
 #include "extensions/common/context.h"
 #include "extensions/stackdriver/common/constants.h"
 #include "extensions/stackdriver/config/v1alpha1/stackdriver_plugin_config.pb.h"
@@ -102,6 +104,9 @@ class StackdriverRootContext : public RootContext {
     // This caches evaluated extra access log labels.
     std::unordered_map<std::string, std::string> extra_log_labels;
     bool expressions_evaluated;
+    // Found peer metadata does not change for the rest of the connection, so
+    // it is resolved once and reused by the periodic records.
+    std::optional<::Wasm::Common::PeerNodeInfo> peer_node_info;
   };
 
   // Indicates whether to export any kind of access log or not.
@@ -142,6 +147,13 @@ class StackdriverRootContext : public RootContext {
   flatbuffers::DetachedBuffer local_node_info_;
   flatbuffers::DetachedBuffer empty_node_info_;
 
+  // Metric tags derived from the local and the peer nodes.
+  ::Extensions::Stackdriver::Metric::TagCache tag_cache_;
+
+  // Set if metrics are batched and recorded on tick.
+  std::unique_ptr<::Extensions::Stackdriver::Metric::MetricBatcher>
+      metric_batcher_;
+
   // Indicates the traffic direction relative to this proxy.
   ::Wasm::Common::TrafficDirection direction_{
       ::Wasm::Common::TrafficDirection::Unspecified};
@@ -168,9 +180,15 @@ class StackdriverRootContext : public RootContext {
 
   long int log_report_duration_nanos_ = kDefaultLogExportNanoseconds;
 
+  // Number of oversized log entries dropped by logger_ as of the last export.
+  uint64_t dropped_log_entries_ = 0;
+
   bool use_host_header_fallback_;
   bool initialized_ = false;
 
+  // Optional request info fields read by the enabled metrics and logs.
+  uint32_t request_fields_ = ::Wasm::Common::kAllRequestFields;
+
   std::unordered_map<uint32_t,
                      std::unique_ptr<StackdriverRootContext::TcpRecordInfo>>
       tcp_request_queue_;
@@ -40,6 +40,7 @@ namespace null_plugin {
 namespace Stats {
 
 const uint32_t kDefaultTCPReportDurationMilliseconds = 15000;  // 15s
+const size_t kMaxPeerDimensionsCacheSize = 500;
 
 using ::nlohmann::json;
 using ::Wasm::Common::GetStringView;
@@ -48,6 +49,7 @@ using ::Wasm::Common::JsonGetField;
 using ::Wasm::Common::JsonObjectIterate;
 using ::Wasm::Common::JsonValueAs;
 using ::Wasm::Common::Protocol;
+using ::Wasm::Common::RequestField;
 
 namespace {
 
@@ -126,25 +128,52 @@ void map_node(IstioDimensions& instance, bool is_source,
   }
 }
 
+// Dimensions filled by map_node, for either side of the request.
+const std::vector<size_t> kSourceNodeDimensions = {
+    source_workload,          source_workload_namespace,
+    source_app,               source_version,
+    source_canonical_service, source_canonical_revision};
+const std::vector<size_t> kDestinationNodeDimensions = {
+    destination_workload,          destination_workload_namespace,
+    destination_app,               destination_version,
+    destination_canonical_service, destination_canonical_revision,
+    destination_service_namespace};
+
+// Dimensions filled by map_request.
+const std::vector<size_t> kRequestDimensions = {
+    source_principal,         destination_principal,
+    destination_service,      destination_service_name,
+    request_protocol,         response_code,
+    response_flags,           connection_security_policy,
+    grpc_response_status};
+
+inline const std::vector<size_t>& peerIndexes(bool outbound) {
+  return outbound ? kDestinationNodeDimensions : kSourceNodeDimensions;
+}
+
+inline const std::vector<size_t>& localIndexes(bool outbound) {
+  return outbound ? kSourceNodeDimensions : kDestinationNodeDimensions;
+}
+
 // Called during request processing.
 void map_peer(IstioDimensions& instance, bool outbound,
               const ::Wasm::Common::FlatNode& peer_node) {
   map_node(instance, !outbound, peer_node);
 }
 
-void map_unknown_if_empty(IstioDimensions& instance) {
-#define SET_IF_EMPTY(name)      \
-  if (instance[name].empty()) { \
-    instance[name] = unknown;   \
+void map_unknown_if_empty(IstioDimensions& instance,
+                          const std::vector<size_t>& indexes) {
+  for (size_t i : indexes) {
+    if (instance[i].empty()) {
+      instance[i] = unknown;
+    }
   }
-  STD_ISTIO_DIMENSIONS(SET_IF_EMPTY)
-#undef SET_IF_EMPTY
 }
 
 // maps from request context to dimensions.
-// local node derived dimensions are already filled in.
+// local and peer node derived dimensions are filled in separately.
 void map_request(IstioDimensions& instance,
-                 const ::Wasm::Common::RequestInfo& request) {
+                 const ::Wasm::Common::ArenaRequestInfo& request) {
   instance[source_principal] = request.source_principal;
   instance[destination_principal] = request.destination_principal;
   instance[destination_service] = request.destination_service_host;
@@ -155,15 +184,7 @@ void map_request(IstioDimensions& instance,
   instance[response_flags] = request.response_flag;
   instance[connection_security_policy] = absl::AsciiStrToLower(std::string(
       ::Wasm::Common::AuthenticationPolicyString(request.service_auth_policy)));
-}
-
-// maps peer_node and request to dimensions.
-void map(IstioDimensions& instance, bool outbound,
-         const ::Wasm::Common::FlatNode& peer_node,
-         const ::Wasm::Common::RequestInfo& request) {
-  map_peer(instance, outbound, peer_node);
-  map_request(instance, request);
-  map_unknown_if_empty(instance);
+  map_unknown_if_empty(instance, kRequestDimensions);
   if (request.request_protocol == Protocol::GRPC) {
     instance[grpc_response_status] = std::to_string(request.grpc_status);
   } else {
@@ -171,6 +192,28 @@ void map(IstioDimensions& instance, bool outbound,
   }
 }
 
+// Optional request info fields read by the metrics of a generator.
+uint32_t requestFields(const StatGen& statgen) {
+  uint32_t fields = 0;
+  for (size_t index : statgen.indexes()) {
+    if (index == response_flags) {
+      fields |= static_cast<uint32_t>(RequestField::ResponseFlag);
+    }
+  }
+  switch (statgen.value()) {
+    case ValueExtractor::RequestDuration:
+      fields |= static_cast<uint32_t>(RequestField::Timing);
+      break;
+    case ValueExtractor::RequestBytes:
+    case ValueExtractor::ResponseBytes:
+      fields |= static_cast<uint32_t>(RequestField::Sizes);
+      break;
+    default:
+      break;
+  }
+  return fields;
+}
+
 }  // namespace
 
 // Ordered dimension list is used by the metrics API.
@@ -187,29 +230,22 @@ const std::vector<MetricFactory>& PluginRootContext::defaultMetrics() {
   static const std::vector<MetricFactory> default_metrics = {
       // HTTP, HTTP/2, and GRPC metrics
       MetricFactory{"requests_total", MetricType::Counter,
-                    [](::Wasm::Common::RequestInfo&) -> uint64_t { return 1; },
+                    ValueExtractor::RequestCount, nullptr,
                     static_cast<uint32_t>(Protocol::HTTP) |
                         static_cast<uint32_t>(Protocol::GRPC),
                     count_standard_labels, /* recurrent */ false},
       MetricFactory{"request_duration_milliseconds", MetricType::Histogram,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      return request_info.duration /* in nanoseconds */ /
-                             1000000;
-                    },
+                    ValueExtractor::RequestDuration, nullptr,
                     static_cast<uint32_t>(Protocol::HTTP) |
                         static_cast<uint32_t>(Protocol::GRPC),
                     count_standard_labels, /* recurrent */ false},
       MetricFactory{"request_bytes", MetricType::Histogram,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      return request_info.request_size;
-                    },
+                    ValueExtractor::RequestBytes, nullptr,
                     static_cast<uint32_t>(Protocol::HTTP) |
                         static_cast<uint32_t>(Protocol::GRPC),
                     count_standard_labels, /* recurrent */ false},
       MetricFactory{"response_bytes", MetricType::Histogram,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      return request_info.response_size;
-                    },
+                    ValueExtractor::ResponseBytes, nullptr,
                     static_cast<uint32_t>(Protocol::HTTP) |
                         static_cast<uint32_t>(Protocol::GRPC),
                     count_standard_labels, /* recurrent */ false},
@@ -218,55 +254,29 @@ const std::vector<MetricFactory>& PluginRootContext::defaultMetrics() {
       // These metrics are dimensioned by peer labels as a minimum.
       // TODO: consider adding connection security policy
       MetricFactory{"request_messages_total", MetricType::Counter,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      uint64_t out = request_info.request_message_count -
-                                     request_info.last_request_message_count;
-                      request_info.last_request_message_count =
-                          request_info.request_message_count;
-                      return out;
-                    },
+                    ValueExtractor::RequestMessages, nullptr,
                     static_cast<uint32_t>(Protocol::GRPC), count_peer_labels,
                     /* recurrent */ true},
       MetricFactory{"response_messages_total", MetricType::Counter,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      uint64_t out = request_info.response_message_count -
-                                     request_info.last_response_message_count;
-                      request_info.last_response_message_count =
-                          request_info.response_message_count;
-                      return out;
-                    },
+                    ValueExtractor::ResponseMessages, nullptr,
                     static_cast<uint32_t>(Protocol::GRPC), count_peer_labels,
                     /* recurrent */ true},
 
       // TCP metrics.
       MetricFactory{"tcp_sent_bytes_total", MetricType::Counter,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      uint64_t out = 0;
-                      std::swap(out, request_info.tcp_sent_bytes);
-                      return out;
-                    },
+                    ValueExtractor::TCPSentBytes, nullptr,
                     static_cast<uint32_t>(Protocol::TCP), count_tcp_labels,
                     /* recurrent */ true},
       MetricFactory{"tcp_received_bytes_total", MetricType::Counter,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      uint64_t out = 0;
-                      std::swap(out, request_info.tcp_received_bytes);
-                      return out;
-                    },
+                    ValueExtractor::TCPReceivedBytes, nullptr,
                     static_cast<uint32_t>(Protocol::TCP), count_tcp_labels,
                     /* recurrent */ true},
       MetricFactory{"tcp_connections_opened_total", MetricType::Counter,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      uint8_t out = 0;
-                      std::swap(out, request_info.tcp_connections_opened);
-                      return out;
-                    },
+                    ValueExtractor::TCPConnectionsOpened, nullptr,
                     static_cast<uint32_t>(Protocol::TCP), count_tcp_labels,
                     /* recurrent */ true},
       MetricFactory{"tcp_connections_closed_total", MetricType::Counter,
-                    [](::Wasm::Common::RequestInfo& request_info) -> uint64_t {
-                      return request_info.tcp_connections_closed;
-                    },
+                    ValueExtractor::TCPConnectionsClosed, nullptr,
                     static_cast<uint32_t>(Protocol::TCP), count_tcp_labels,
                     /* recurrent */ false},
   };
@@ -312,15 +322,17 @@ bool PluginRootContext::initializeDimensions(const json& j) {
         }
         auto& factory = factories[name];
         factory.name = name;
-        factory.extractor = [token, name,
-                             value](::Wasm::Common::RequestInfo&) -> uint64_t {
-          int64_t result = 0;
-          if (!evaluateExpression(token.value(), &result)) {
-            LOG_TRACE(absl::StrCat("Failed to evaluate expression: <", value,
-                                   "> for dimension:<", name, ">"));
-          }
-          return result;
-        };
+        factory.value = ValueExtractor::Custom;
+        factory.extractor =
+            [token, name,
+             value](::Wasm::Common::ArenaRequestInfo&) -> uint64_t {
+              int64_t result = 0;
+              if (!evaluateExpression(token.value(), &result)) {
+                LOG_TRACE(absl::StrCat("Failed to evaluate expression: <",
+                                       value, "> for dimension:<", name, ">"));
+              }
+              return result;
+            };
         factory.type = MetricType::Counter;
         factory.recurrent = false;
         factory.protocols = static_cast<uint32_t>(Protocol::HTTP) |
@@ -414,6 +426,15 @@ bool PluginRootContext::initializeDimensions(const json& j) {
   const auto& local_node =
       *flatbuffers::GetRoot<::Wasm::Common::FlatNode>(local_node_info_.data());
   map_node(istio_dimensions_, outbound_, local_node);
+  map_unknown_if_empty(istio_dimensions_, localIndexes(outbound_));
+  istio_dimensions_key_.resize(istio_dimensions_.size());
+  // Cached stats refer to the extractors of the previous stat generators, and
+  // to the symbols of the previous local dimensions.
+  metrics_.clear();
+  peer_dimensions_.clear();
+  symbols_.clear();
+  internLocalDimensions();
+  updateCacheGauges();
 
   // Instantiate stat factories using the new dimensions
   auto field_separator = JsonGetField<std::string>(j, "field_separator")
@@ -445,6 +466,35 @@ bool PluginRootContext::initializeDimensions(const json& j) {
                         field_separator, value_separator);
   }
 
+  // Only fetch the optional request fields read by the metrics. Dimension
+  // overrides and removed tags are already reflected in the indexes.
+  request_fields_ = 0;
+  for (const auto& statgen : stats_) {
+    request_fields_ |= requestFields(statgen);
+  }
+
+  // Partition the generators by protocol, recurrent ones first.
+  tcp_stats_.clear();
+  http_stats_.clear();
+  grpc_stats_.clear();
+  for (bool recurrent : {true, false}) {
+    for (size_t i = 0; i < stats_.size(); i++) {
+      const auto& statgen = stats_[i];
+      if (statgen.recurrent_ != recurrent) {
+        continue;
+      }
+      if (statgen.matchesProtocol(Protocol::TCP)) {
+        tcp_stats_.push_back(i);
+      }
+      if (statgen.matchesProtocol(Protocol::HTTP)) {
+        http_stats_.push_back(i);
+      }
+      if (statgen.matchesProtocol(Protocol::GRPC)) {
+        grpc_stats_.push_back(i);
+      }
+    }
+  }
+
   Metric build(MetricType::Gauge, absl::StrCat(stat_prefix, "build"),
                {MetricTag{"component", MetricTag::TagType::String},
                 MetricTag{"tag", MetricTag::TagType::String}});
@@ -481,6 +531,22 @@ bool PluginRootContext::configure(size_t configuration_size) {
     return false;
   }
 
+  max_metric_cache_entries_ =
+      JsonGetField<uint64_t>(j, "max_metric_cache_entries").value_or(0);
+  max_metric_cache_bytes_ =
+      JsonGetField<uint64_t>(j, "max_metric_cache_bytes").value_or(0);
+  metrics_.setLimits(max_metric_cache_entries_, max_metric_cache_bytes_);
+  peer_dimensions_.setMaxEntries(kMaxPeerDimensionsCacheSize);
+
+  if (batch_) {
+    batch_->flush();
+  }
+  auto metric_batch_size =
+      JsonGetField<uint64_t>(j, "metric_batch_size").value_or(0);
+  batch_ = metric_batch_size > 0
+               ? std::make_unique<MetricBatch>(metric_batch_size)
+               : nullptr;
+
   // TODO: rename to reporting_duration
   uint32_t tcp_report_duration_milis = kDefaultTCPReportDurationMilliseconds;
   auto tcp_reporting_duration_field =
@@ -541,7 +607,14 @@ std::optional<uint32_t> PluginRootContext::addIntExpression(
 }
 
 bool PluginRootContext::onDone() {
+  if (batch_) {
+    batch_->flush();
+  }
   cleanupExpressions();
+  metrics_.clear();
+  peer_dimensions_.clear();
+  symbols_.clear();
+  updateCacheGauges();
   if (!request_queue_.empty()) {
     LOG_CRITICAL(absl::StrCat("Request queue is not empty, dropping requests: ",
                               request_queue_.size()));
@@ -550,30 +623,47 @@ bool PluginRootContext::onDone() {
 }
 
 void PluginRootContext::onTick() {
-  if (request_queue_.empty()) {
-    return;
-  }
-  for (auto const& item : request_queue_) {
-    // requestinfo is null, so continue.
-    if (item.second == nullptr) {
+  for (auto it = request_queue_.begin(); it != request_queue_.end();) {
+    auto* stream_info = it->second;
+    // streaminfo is null, so continue.
+    if (stream_info == nullptr) {
+      ++it;
       continue;
     }
-    Context* context = getContext(item.first);
+    Context* context = getContext(it->first);
     if (context == nullptr) {
+      ++it;
       continue;
     }
     context->setEffectiveContext();
-    report(*item.second, false);
+    report(*stream_info, false);
+    const auto& request_info = stream_info->request_info;
+    // Idle TCP streams are not visited until the next data callback queues
+    // them again. Values are kept when the report waited for peer metadata.
+    if (request_info.request_protocol == Protocol::TCP &&
+        request_info.tcp_connections_opened == 0 &&
+        request_info.tcp_sent_bytes == 0 &&
+        request_info.tcp_received_bytes == 0) {
+      it = request_queue_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (batch_) {
+    batch_->flush();
   }
 }
 
-void PluginRootContext::report(::Wasm::Common::RequestInfo& request_info,
-                               bool end_stream) {
+void PluginRootContext::report(StreamInfo& stream_info, bool end_stream) {
+  auto& request_info = stream_info.request_info;
   // HTTP peer metadata should be done by the time report is called for a
   // request info. TCP metadata might still be awaiting.
   // Upstream host should be selected for metadata fallback.
-  Wasm::Common::PeerNodeInfo peer_node_info(peer_metadata_id_key_,
-                                            peer_metadata_key_);
+  if (!stream_info.peer_node_info || !stream_info.peer_node_info->found()) {
+    stream_info.peer_node_info.emplace(peer_metadata_id_key_,
+                                       peer_metadata_key_);
+  }
+  const auto& peer_node_info = *stream_info.peer_node_info;
   if (request_info.request_protocol == Protocol::TCP) {
     // For TCP, if peer metadata is not available, peer id is set as not found.
     // Otherwise, we wait for metadata exchange to happen before we report any
@@ -581,14 +671,15 @@ void PluginRootContext::report(::Wasm::Common::RequestInfo& request_info,
     if (peer_node_info.maybeWaiting() && !end_stream) {
       return;
     }
-    ::Wasm::Common::populateTCPRequestInfo(outbound_, &request_info);
+    ::Wasm::Common::populateTCPRequestInfo(outbound_, &request_info,
+                                           request_fields_);
   } else {
     // Populate HTTP request info fully only at the end of the stream because
     // onTick context has no access to request/response headers but can read
     // from filter state.
     if (end_stream) {
       ::Wasm::Common::populateHTTPRequestInfo(
-          outbound_, useHostHeaderFallback(), &request_info);
+          outbound_, useHostHeaderFallback(), &request_info, request_fields_);
     } else {
       ::Wasm::Common::populateRequestInfo(outbound_, useHostHeaderFallback(),
                                           &request_info);
@@ -598,23 +689,37 @@ void PluginRootContext::report(::Wasm::Common::RequestInfo& request_info,
     }
   }
 
-  map(istio_dimensions_, outbound_, peer_node_info.get(), request_info);
+  report_count_++;
+  const auto& peer_dimensions = peerDimensions(peer_node_info);
+  const auto& peer_indexes = peerIndexes(outbound_);
+  for (size_t i = 0; i < peer_indexes.size(); i++) {
+    istio_dimensions_key_.set(peer_indexes[i], peer_dimensions[i]);
+  }
+
+  map_request(istio_dimensions_, request_info);
+  for (size_t i : kRequestDimensions) {
+    istio_dimensions_key_.set(i, symbols_.intern(istio_dimensions_[i]));
+  }
 
   for (size_t i = 0; i < expressions_.size(); i++) {
-    if (!evaluateExpression(expressions_[i].token,
-                            &istio_dimensions_.at(count_standard_labels + i))) {
+    auto& value = istio_dimensions_.at(count_standard_labels + i);
+    if (!evaluateExpression(expressions_[i].token, &value)) {
       LOG_TRACE(absl::StrCat("Failed to evaluate expression: <",
                              expressions_[i].expression, ">"));
-      istio_dimensions_[count_standard_labels + i] = "unknown";
+      value = "unknown";
     }
+    istio_dimensions_key_.set(count_standard_labels + i,
+                              symbols_.intern(value));
   }
-
-  auto stats_it = metrics_.find(istio_dimensions_);
-  if (stats_it != metrics_.end()) {
-    for (auto& stat : stats_it->second) {
-      if (end_stream || stat.recurrent_) {
-        stat.record(request_info);
-      }
+  istio_dimensions_key_.rehash();
+
+  auto* cached_stats = metrics_.find(istio_dimensions_key_, report_count_);
+  if (cached_stats != nullptr) {
+    size_t count = end_stream ? cached_stats->stats.size()
+                              : cached_stats->recurrent_count;
+    for (size_t i = 0; i < count; i++) {
+      auto& stat = cached_stats->stats[i];
+      stat.record(request_info, batch_.get());
       LOG_DEBUG(
           absl::StrCat("metricKey cache hit ", ", stat=", stat.metric_id_));
     }
@@ -626,28 +731,111 @@ void PluginRootContext::report(::Wasm::Common::RequestInfo& request_info,
     return;
   }
 
-  std::vector<SimpleStat> stats;
-  for (auto& statgen : stats_) {
-    if (!statgen.matchesProtocol(request_info.request_protocol)) {
-      continue;
-    }
-    auto stat = statgen.resolve(istio_dimensions_);
+  // Peer dimensions are only materialized for resolving new metrics.
+  for (size_t i = 0; i < peer_indexes.size(); i++) {
+    istio_dimensions_[peer_indexes[i]] = symbols_.value(peer_dimensions[i]);
+  }
+
+  ResolvedStats resolved;
+  const auto& stat_indexes = protocolStats(request_info.request_protocol);
+  resolved.stats.reserve(stat_indexes.size());
+  for (size_t index : stat_indexes) {
+    auto& statgen = stats_[index];
+    auto stat = statgen.resolve(istio_dimensions_, stat_name_buffer_);
     LOG_DEBUG(absl::StrCat("metricKey cache miss ", statgen.name(), " ",
                            ", stat=", stat.metric_id_,
                            ", recurrent=", stat.recurrent_));
     if (end_stream || stat.recurrent_) {
-      stat.record(request_info);
+      stat.record(request_info, batch_.get());
     }
-    stats.push_back(stat);
+    if (stat.recurrent_) {
+      resolved.recurrent_count++;
+    }
+    resolved.stats.push_back(stat);
   }
 
   incrementMetric(cache_misses_, 1);
-  metrics_.try_emplace(istio_dimensions_, stats);
+  size_t evicted = metrics_.insert(istio_dimensions_key_, std::move(resolved),
+                                   report_count_);
+  if (evicted > 0) {
+    incrementMetric(cache_evictions_, evicted);
+  }
+  updateCacheGauges();
+}
+
+void PluginRootContext::internLocalDimensions() {
+  // Local symbols stay referenced until the symbol table is cleared.
+  auto intern = [this](size_t index) {
+    Symbol symbol = symbols_.intern(istio_dimensions_[index]);
+    symbols_.ref(symbol);
+    istio_dimensions_key_.set(index, symbol);
+  };
+  intern(reporter);
+  for (size_t i : localIndexes(outbound_)) {
+    intern(i);
+  }
+}
+
+void PluginRootContext::updateCacheGauges() {
+  int64_t entries = metrics_.size();
+  int64_t bytes = metrics_.totalBytes();
+  if (entries != reported_cache_entries_) {
+    incrementMetric(cache_entries_, entries - reported_cache_entries_);
+    reported_cache_entries_ = entries;
+  }
+  if (bytes != reported_cache_bytes_) {
+    incrementMetric(cache_bytes_, bytes - reported_cache_bytes_);
+    reported_cache_bytes_ = bytes;
+  }
+}
+
+const std::vector<size_t>& PluginRootContext::protocolStats(
+    Protocol protocol) const {
+  static const std::vector<size_t> empty;
+  switch (protocol) {
+    case Protocol::TCP:
+      return tcp_stats_;
+    case Protocol::HTTP:
+      return http_stats_;
+    case Protocol::GRPC:
+      return grpc_stats_;
+    default:
+      break;
+  }
+  return empty;
+}
+
+const std::vector<Symbol>& PluginRootContext::peerDimensions(
+    const ::Wasm::Common::PeerNodeInfo& peer_node_info) {
+  if (peer_node_info.found()) {
+    // Reuse the capacity of the lookup key, the map has no heterogeneous
+    // lookup.
+    peer_id_.assign(peer_node_info.id());
+    const auto* cached = peer_dimensions_.find(peer_id_, report_count_);
+    if (cached != nullptr) {
+      return *cached;
+    }
+  }
+
+  map_peer(istio_dimensions_, outbound_, peer_node_info.get());
+  const auto& peer_indexes = peerIndexes(outbound_);
+  map_unknown_if_empty(istio_dimensions_, peer_indexes);
+  fallback_peer_dimensions_.resize(peer_indexes.size());
+  for (size_t i = 0; i < peer_indexes.size(); i++) {
+    fallback_peer_dimensions_[i] =
+        symbols_.intern(istio_dimensions_[peer_indexes[i]]);
+  }
+  // The fallback dimensions are only used by the current report.
+  if (!peer_node_info.found()) {
+    return fallback_peer_dimensions_;
+  }
+  return peer_dimensions_.insert(peer_id_, fallback_peer_dimensions_,
+                                 report_count_);
 }
 
-void PluginRootContext::addToRequestQueue(
-    uint32_t context_id, ::Wasm::Common::RequestInfo* request_info) {
-  request_queue_[context_id] = request_info;
+void PluginRootContext::addToRequestQueue(uint32_t context_id,
+                                          StreamInfo* stream_info) {
+  request_queue_.try_emplace(context_id, stream_info);
 }
 
 void PluginRootContext::deleteFromRequestQueue(uint32_t context_id) {
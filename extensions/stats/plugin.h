@@ -15,6 +15,11 @@
 
 #pragma once
 
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <optional>
 #include <unordered_map>
 
 #include "absl/strings/str_join.h"
@@ -108,38 +113,256 @@ const size_t count_peer_labels =
 const size_t count_tcp_labels =
     static_cast<size_t>(StandardLabels::connection_security_policy) + 1;
 
-struct HashIstioDimensions {
-  size_t operator()(const IstioDimensions& c) const {
+// Interned dimension value. Symbols are only meaningful within the symbol
+// table that produced them.
+using Symbol = uint32_t;
+
+// SymbolTable interns dimension values so that the metric cache can be keyed
+// by compact integer arrays instead of string vectors. Symbols are reference
+// counted by their users, and the slot of a released value is reused by the
+// next new value.
+class SymbolTable {
+ public:
+  // A new symbol is unreferenced, and is only valid until the next release.
+  Symbol intern(std::string_view value) {
+    auto it = symbols_.find(value);
+    if (it != symbols_.end()) {
+      return it->second;
+    }
+    Symbol symbol;
+    if (free_.empty()) {
+      symbol = static_cast<Symbol>(values_.size());
+      // Deque elements are never relocated, so the views stay valid.
+      values_.emplace_back(value);
+      refs_.push_back(0);
+    } else {
+      symbol = free_.back();
+      free_.pop_back();
+      values_[symbol].assign(value.data(), value.size());
+    }
+    symbols_.emplace(values_[symbol], symbol);
+    bytes_ += valueBytes(value);
+    return symbol;
+  }
+
+  void ref(Symbol symbol) { refs_[symbol]++; }
+  // Releases the value once the last reference is dropped.
+  void unref(Symbol symbol) {
+    if (--refs_[symbol] > 0) {
+      return;
+    }
+    auto& value = values_[symbol];
+    symbols_.erase(value);
+    bytes_ -= valueBytes(value);
+    std::string().swap(value);
+    free_.push_back(symbol);
+  }
+
+  std::string_view value(Symbol symbol) const { return values_[symbol]; }
+  // Number of live values.
+  size_t size() const { return values_.size() - free_.size(); }
+  // Approximate memory used by the live values.
+  size_t bytes() const { return bytes_; }
+
+  void clear() {
+    symbols_.clear();
+    values_.clear();
+    refs_.clear();
+    free_.clear();
+    bytes_ = 0;
+  }
+
+ private:
+  static size_t valueBytes(std::string_view value) {
+    return value.size() + sizeof(std::string) + sizeof(uint32_t) +
+           sizeof(std::pair<std::string_view, Symbol>) + sizeof(void*);
+  }
+
+  std::deque<std::string> values_;
+  std::vector<uint32_t> refs_;
+  // Released slots of values_.
+  std::vector<Symbol> free_;
+  Map<std::string_view, Symbol> symbols_;
+  size_t bytes_ = 0;
+};
+
+// IstioDimensionsKey is the interned form of IstioDimensions. The hash is
+// computed once when the key is assigned, so that a cache lookup costs one
+// hash read and a memory comparison.
+class IstioDimensionsKey {
+ public:
+  void assign(const IstioDimensions& instance, SymbolTable& table) {
+    resize(instance.size());
+    for (size_t i = 0; i < instance.size(); i++) {
+      set(i, table.intern(instance[i]));
+    }
+    rehash();
+  }
+
+  // Incremental updates: positions can be overwritten individually, but the
+  // hash is only valid after calling rehash().
+  void resize(size_t size) { symbols_.resize(size); }
+  void set(size_t index, Symbol symbol) { symbols_[index] = symbol; }
+  void rehash() {
     const size_t kMul = static_cast<size_t>(0x9ddfea08eb382d69);
-    size_t h = 0;
-    for (const auto& value : c) {
-      h += std::hash<std::string>()(value) * kMul;
+    size_t h = symbols_.size();
+    for (Symbol symbol : symbols_) {
+      h = (h ^ symbol) * kMul;
+      h ^= h >> 47;
     }
-    return h;
+    hash_ = h;
   }
+
+  size_t hash() const { return hash_; }
+  size_t size() const { return symbols_.size(); }
+  const std::vector<Symbol>& symbols() const { return symbols_; }
+
+  bool operator==(const IstioDimensionsKey& other) const {
+    return hash_ == other.hash_ && symbols_.size() == other.symbols_.size() &&
+           std::memcmp(symbols_.data(), other.symbols_.data(),
+                       symbols_.size() * sizeof(Symbol)) == 0;
+  }
+
+ private:
+  std::vector<Symbol> symbols_;
+  size_t hash_ = 0;
+};
+
+struct HashIstioDimensionsKey {
+  size_t operator()(const IstioDimensionsKey& key) const { return key.hash(); }
 };
 
 // Value extractor can mutate the request info to flush data between multiple
 // reports.
 using ValueExtractorFn =
-    std::function<uint64_t(::Wasm::Common::RequestInfo& request_info)>;
+    std::function<uint64_t(::Wasm::Common::ArenaRequestInfo& request_info)>;
+
+// Values of the built-in metrics, dispatched statically by extractValue.
+// Custom metric definitions use a ValueExtractorFn instead.
+enum class ValueExtractor : uint8_t {
+  Custom,
+  RequestCount,
+  RequestDuration,
+  RequestBytes,
+  ResponseBytes,
+  RequestMessages,
+  ResponseMessages,
+  TCPSentBytes,
+  TCPReceivedBytes,
+  TCPConnectionsOpened,
+  TCPConnectionsClosed,
+};
+
+inline uint64_t extractValue(ValueExtractor extractor,
+                             ::Wasm::Common::ArenaRequestInfo& request_info) {
+  switch (extractor) {
+    case ValueExtractor::RequestCount:
+      return 1;
+    case ValueExtractor::RequestDuration:
+      return request_info.duration /* in nanoseconds */ / 1000000;
+    case ValueExtractor::RequestBytes:
+      return request_info.request_size;
+    case ValueExtractor::ResponseBytes:
+      return request_info.response_size;
+    case ValueExtractor::RequestMessages: {
+      uint64_t out = request_info.request_message_count -
+                     request_info.last_request_message_count;
+      request_info.last_request_message_count =
+          request_info.request_message_count;
+      return out;
+    }
+    case ValueExtractor::ResponseMessages: {
+      uint64_t out = request_info.response_message_count -
+                     request_info.last_response_message_count;
+      request_info.last_response_message_count =
+          request_info.response_message_count;
+      return out;
+    }
+    case ValueExtractor::TCPSentBytes: {
+      uint64_t out = 0;
+      std::swap(out, request_info.tcp_sent_bytes);
+      return out;
+    }
+    case ValueExtractor::TCPReceivedBytes: {
+      uint64_t out = 0;
+      std::swap(out, request_info.tcp_received_bytes);
+      return out;
+    }
+    case ValueExtractor::TCPConnectionsOpened: {
+      uint8_t out = 0;
+      std::swap(out, request_info.tcp_connections_opened);
+      return out;
+    }
+    case ValueExtractor::TCPConnectionsClosed:
+      return request_info.tcp_connections_closed;
+    case ValueExtractor::Custom:
+      break;
+  }
+  return 0;
+}
+
+// MetricBatch accumulates counter increments and gauge values by metric ID,
+// so that they cross into the host once per flush instead of once per
+// report. Histogram samples are not batched since each sample is a separate
+// host call either way.
+class MetricBatch {
+ public:
+  explicit MetricBatch(size_t max_size) : max_size_(max_size) {}
+
+  // Returns true if the batch is full and should be flushed.
+  bool add(uint32_t metric_id, MetricType type, uint64_t value) {
+    auto& pending = pending_[metric_id];
+    if (type == MetricType::Counter) {
+      pending += value;
+    } else {
+      pending = value;
+    }
+    return pending_.size() >= max_size_;
+  }
+
+  void flush() {
+    for (const auto& [metric_id, value] : pending_) {
+      recordMetric(metric_id, value);
+    }
+    pending_.clear();
+  }
+
+  size_t size() const { return pending_.size(); }
+
+ private:
+  const size_t max_size_;
+  Map<uint32_t, uint64_t> pending_;
+};
 
 // SimpleStat record a pre-resolved metric based on the values function.
+// Custom value functions are owned by the StatGen that resolved the stat.
 class SimpleStat {
  public:
-  SimpleStat(uint32_t metric_id, ValueExtractorFn value_fn, MetricType type,
+  SimpleStat(uint32_t metric_id, ValueExtractor value,
+             const ValueExtractorFn* custom_value_fn, MetricType type,
              bool recurrent)
       : metric_id_(metric_id),
         recurrent_(recurrent),
-        value_fn_(value_fn),
-        type_(type){};
-
-  inline void record(::Wasm::Common::RequestInfo& request_info) {
-    const uint64_t val = value_fn_(request_info);
+        value_(value),
+        type_(type),
+        custom_value_fn_(custom_value_fn){};
+
+  // Records the value directly, or into the batch if one is provided.
+  inline void record(::Wasm::Common::ArenaRequestInfo& request_info,
+                     MetricBatch* batch = nullptr) {
+    const uint64_t val = value_ == ValueExtractor::Custom
+                             ? (*custom_value_fn_)(request_info)
+                             : extractValue(value_, request_info);
     // Optimization: do not record 0 COUNTER values
     if (type_ == MetricType::Counter && val == 0) {
       return;
     }
+    if (batch != nullptr && type_ != MetricType::Histogram) {
+      if (batch->add(metric_id_, type_, val)) {
+        batch->flush();
+      }
+      return;
+    }
     recordMetric(metric_id_, val);
   };
 
@@ -147,14 +370,17 @@ class SimpleStat {
   const bool recurrent_;
 
  private:
-  ValueExtractorFn value_fn_;
+  ValueExtractor value_;
   MetricType type_;
+  const ValueExtractorFn* custom_value_fn_;
 };
 
 // MetricFactory creates a stat generator given tags.
 struct MetricFactory {
   std::string name;
   MetricType type;
+  ValueExtractor value;
+  // Only used for ValueExtractor::Custom.
   ValueExtractorFn extractor;
   uint32_t protocols;
   size_t count_labels;
@@ -174,6 +400,7 @@ class StatGen {
       : recurrent_(metric_factory.recurrent),
         protocols_(metric_factory.protocols),
         indexes_(indexes),
+        value_(metric_factory.value),
         extractor_(metric_factory.extractor),
         metric_(metric_factory.type,
                 absl::StrCat(stat_prefix, metric_factory.name), tags,
@@ -181,40 +408,40 @@ class StatGen {
     if (tags.size() != indexes.size()) {
       logAbort("metric tags.size() != indexes.size()");
     }
+    // Precompute the static parts of the tag-encoded name:
+    // prefix tag_0 value_sep ... field_sep tag_n value_sep ... field_sep name
+    name_segments_.reserve(tags.size() + 1);
+    std::string segment = metric_.prefix;
+    for (const auto& tag : metric_.tags) {
+      absl::StrAppend(&segment, tag.name, metric_.value_separator);
+      name_segments_.push_back(std::move(segment));
+      segment = metric_.field_separator;
+    }
+    segment.append(metric_.name);
+    name_segments_.push_back(std::move(segment));
   };
 
   StatGen() = delete;
   inline std::string_view name() const { return metric_.name; };
+  inline const std::vector<size_t>& indexes() const { return indexes_; };
+  inline ValueExtractor value() const { return value_; };
   inline bool matchesProtocol(::Wasm::Common::Protocol protocol) const {
     return (protocols_ & static_cast<uint32_t>(protocol)) != 0;
   }
 
   // Resolve metric based on provided dimension values by
   // combining the tags with the indexed dimensions and resolving
-  // to a metric ID.
-  SimpleStat resolve(const IstioDimensions& instance) {
-    // Using a lower level API to avoid creating an intermediary vector
-    size_t s = metric_.prefix.size();
-    for (const auto& tag : metric_.tags) {
-      s += tag.name.size() + metric_.value_separator.size();
-    }
-    for (size_t i : indexes_) {
-      s += instance[i].size() + metric_.field_separator.size();
+  // to a metric ID. The full name is built in the provided buffer, so that
+  // its capacity can be reused across calls.
+  SimpleStat resolve(const IstioDimensions& instance, std::string& name) {
+    name.assign(name_segments_[0]);
+    for (size_t i = 0; i < indexes_.size(); i++) {
+      name.append(instance[indexes_[i]]);
+      name.append(name_segments_[i + 1]);
     }
-    s += metric_.name.size();
-
-    std::string n;
-    n.reserve(s);
-    n.append(metric_.prefix);
-    for (size_t i = 0; i < metric_.tags.size(); i++) {
-      n.append(metric_.tags[i].name);
-      n.append(metric_.value_separator);
-      n.append(instance[indexes_[i]]);
-      n.append(metric_.field_separator);
-    }
-    n.append(metric_.name);
-    auto metric_id = metric_.resolveFullName(n);
-    return SimpleStat(metric_id, extractor_, metric_.type, recurrent_);
+    auto metric_id = metric_.resolveFullName(name);
+    return SimpleStat(metric_id, value_, &extractor_, metric_.type,
+                      recurrent_);
   };
 
   const bool recurrent_;
@@ -222,8 +449,268 @@ class StatGen {
  private:
   const uint32_t protocols_;
   const std::vector<size_t> indexes_;
+  const ValueExtractor value_;
   const ValueExtractorFn extractor_;
   Metric metric_;
+  // Static name parts, one more than the number of tags.
+  std::vector<std::string> name_segments_;
+};
+
+// ResolvedStats holds the metrics resolved for a dimension set. Recurrent
+// stats are ordered first, so that mid-stream reports only record a prefix.
+struct ResolvedStats {
+  std::vector<SimpleStat> stats;
+  size_t recurrent_count = 0;
+};
+
+// PeerDimensionsCache maps peer IDs to their interned dimensions, which do not
+// change for a given ID. Least recently used peers are evicted one at a time
+// beyond the entry limit, and by the metric cache beyond its byte budget. The
+// entries hold a reference to their symbols.
+class PeerDimensionsCache {
+ public:
+  explicit PeerDimensionsCache(SymbolTable& symbols) : symbols_(symbols) {}
+
+  // Zero means no limit.
+  void setMaxEntries(size_t max_entries) { max_entries_ = max_entries; }
+
+  // Returns the peer dimensions and marks the peer as most recently used at
+  // `now`, or nullptr if the peer is absent.
+  const std::vector<Symbol>* find(const std::string& id, uint64_t now = 0) {
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+      return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    it->second.used = now;
+    return &it->second.dimensions;
+  }
+
+  // Inserts the dimensions of a new peer and references their symbols.
+  // Returns the stored dimensions, which are never evicted by the insertion.
+  const std::vector<Symbol>& insert(const std::string& id,
+                                    const std::vector<Symbol>& dimensions,
+                                    uint64_t now = 0) {
+    auto result = entries_.try_emplace(id);
+    auto& entry = result.first->second;
+    if (result.second) {
+      entry.dimensions = dimensions;
+      entry.bytes = sizeof(Entry) + sizeof(std::string) + id.size() +
+                    dimensions.size() * sizeof(Symbol) +
+                    4 * sizeof(void*) /* list and bucket nodes */;
+      entry.lru = lru_.insert(lru_.begin(), &result.first->first);
+      bytes_ += entry.bytes;
+      for (Symbol symbol : dimensions) {
+        symbols_.ref(symbol);
+      }
+    }
+    entry.used = now;
+    while (max_entries_ > 0 && entries_.size() > max_entries_) {
+      evict();
+    }
+    return entry.dimensions;
+  }
+
+  // Evicts the least recently used peer, unless it is the only one. Returns
+  // whether a peer was evicted.
+  bool evict() {
+    if (entries_.size() <= 1) {
+      return false;
+    }
+    auto it = entries_.find(*lru_.back());
+    bytes_ -= it->second.bytes;
+    for (Symbol symbol : it->second.dimensions) {
+      symbols_.unref(symbol);
+    }
+    lru_.pop_back();
+    entries_.erase(it);
+    return true;
+  }
+
+  // Returns the use stamp of the least recently used peer, or nothing if the
+  // cache is empty.
+  std::optional<uint64_t> oldest() const {
+    if (lru_.empty()) {
+      return {};
+    }
+    return entries_.find(*lru_.back())->second.used;
+  }
+
+  void clear() {
+    for (const auto& entry : entries_) {
+      for (Symbol symbol : entry.second.dimensions) {
+        symbols_.unref(symbol);
+      }
+    }
+    entries_.clear();
+    lru_.clear();
+    bytes_ = 0;
+  }
+
+  size_t size() const { return entries_.size(); }
+  // Approximate memory used by the cache entries, excluding the symbols.
+  size_t bytes() const { return bytes_; }
+
+ private:
+  struct Entry {
+    std::vector<Symbol> dimensions;
+    size_t bytes;
+    uint64_t used;
+    // Position in the recency list, which points back at the map key.
+    std::list<const std::string*>::iterator lru;
+  };
+
+  // Node-based map so that the key addresses in lru_ stay valid.
+  std::unordered_map<std::string, Entry> entries_;
+  // Most recently used first.
+  std::list<const std::string*> lru_;
+  SymbolTable& symbols_;
+  size_t bytes_ = 0;
+  size_t max_entries_ = 0;
+};
+
+// MetricCache maps interned dimensions to the resolved metrics. The cache is
+// optionally bounded by the number of entries and by their approximate memory
+// size, in which case the least recently used entries are evicted first. The
+// entries hold a reference to their symbols, and the memory size includes the
+// symbol table, so that evictions release the values no longer used. The
+// memory size also includes the optional peer dimensions cache, whose entries
+// are evicted along with the metric entries by recency.
+class MetricCache {
+ public:
+  explicit MetricCache(SymbolTable& symbols,
+                       PeerDimensionsCache* peers = nullptr)
+      : symbols_(symbols), peers_(peers) {}
+
+  // Zero means no limit.
+  void setLimits(size_t max_entries, size_t max_bytes) {
+    max_entries_ = max_entries;
+    max_bytes_ = max_bytes;
+  }
+
+  // Returns the resolved metrics and marks the entry as most recently used at
+  // `now`, or nullptr if the key is absent.
+  ResolvedStats* find(const IstioDimensionsKey& key, uint64_t now = 0) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    it->second.used = now;
+    return &it->second.stats;
+  }
+
+  // Inserts the resolved metrics for a key and returns the number of entries
+  // evicted to stay within the limits, including the peer dimensions. The new
+  // entry and the most recent peer are never evicted.
+  size_t insert(const IstioDimensionsKey& key, ResolvedStats&& stats,
+                uint64_t now = 0) {
+    size_t entry_bytes = sizeof(Entry) + sizeof(IstioDimensionsKey) +
+                         key.size() * sizeof(Symbol) +
+                         stats.stats.size() * sizeof(SimpleStat) +
+                         4 * sizeof(void*) /* list and bucket nodes */;
+    auto result = entries_.try_emplace(key);
+    if (!result.second) {
+      return 0;
+    }
+    auto& entry = result.first->second;
+    entry.stats = std::move(stats);
+    entry.bytes = entry_bytes;
+    entry.used = now;
+    entry.lru = lru_.insert(lru_.begin(), &result.first->first);
+    bytes_ += entry_bytes;
+    // Referenced before evicting, which may release symbols shared with the
+    // new key.
+    for (Symbol symbol : key.symbols()) {
+      symbols_.ref(symbol);
+    }
+
+    size_t evicted = 0;
+    while (entries_.size() > 1 && max_entries_ > 0 &&
+           entries_.size() > max_entries_) {
+      evict();
+      evicted++;
+    }
+    while (max_bytes_ > 0 && totalBytes() > max_bytes_) {
+      // The older of the least recently used metric and peer goes first.
+      auto oldest_peer = peers_ != nullptr && peers_->size() > 1
+                             ? peers_->oldest()
+                             : std::nullopt;
+      bool evict_entry = entries_.size() > 1;
+      if (evict_entry && oldest_peer.has_value()) {
+        evict_entry =
+            entries_.find(*lru_.back())->second.used <= *oldest_peer;
+      }
+      if (evict_entry) {
+        evict();
+      } else if (!oldest_peer.has_value() || !peers_->evict()) {
+        break;
+      }
+      evicted++;
+    }
+    return evicted;
+  }
+
+  void clear() {
+    for (const auto& it : entries_) {
+      for (Symbol symbol : it.first.symbols()) {
+        symbols_.unref(symbol);
+      }
+    }
+    entries_.clear();
+    lru_.clear();
+    bytes_ = 0;
+  }
+
+  size_t size() const { return entries_.size(); }
+  // Approximate memory used by the cache entries, excluding the symbols.
+  size_t bytes() const { return bytes_; }
+  // Approximate memory counted against the byte budget.
+  size_t totalBytes() const {
+    return bytes_ + symbols_.bytes() +
+           (peers_ != nullptr ? peers_->bytes() : 0);
+  }
+
+ private:
+  struct Entry {
+    ResolvedStats stats;
+    size_t bytes;
+    uint64_t used;
+    // Position in the recency list, which points back at the map key.
+    std::list<const IstioDimensionsKey*>::iterator lru;
+  };
+
+  // Evicts the least recently used entry.
+  void evict() {
+    auto it = entries_.find(*lru_.back());
+    bytes_ -= it->second.bytes;
+    for (Symbol symbol : it->first.symbols()) {
+      symbols_.unref(symbol);
+    }
+    lru_.pop_back();
+    entries_.erase(it);
+  }
+
+  // Node-based map so that the key addresses in lru_ stay valid.
+  std::unordered_map<IstioDimensionsKey, Entry, HashIstioDimensionsKey>
+      entries_;
+  // Most recently used first.
+  std::list<const IstioDimensionsKey*> lru_;
+  SymbolTable& symbols_;
+  PeerDimensionsCache* peers_;
+  size_t bytes_ = 0;
+  size_t max_entries_ = 0;
+  size_t max_bytes_ = 0;
+};
+
+// Per-stream state kept across the reports of a stream.
+struct StreamInfo {
+  // String fields are backed by the arena of the request info, which is
+  // released together with the stream.
+  ::Wasm::Common::ArenaRequestInfo request_info;
+  // Found peer metadata does not change for the rest of the stream, so it is
+  // resolved once and reused by the recurrent reports.
+  std::optional<::Wasm::Common::PeerNodeInfo> peer_node_info;
 };
 
 // PluginRootContext is the root context for all streams processed by the
@@ -238,6 +725,14 @@ class PluginRootContext : public RootContext {
                         MetricTag{"cache", MetricTag::TagType::String}});
     cache_hits_ = cache_count.resolve("stats_filter", "hit");
     cache_misses_ = cache_count.resolve("stats_filter", "miss");
+    cache_evictions_ = cache_count.resolve("stats_filter", "eviction");
+    Metric cache_entries(
+        MetricType::Gauge, "metric_cache_entries",
+        {MetricTag{"wasm_filter", MetricTag::TagType::String}});
+    cache_entries_ = cache_entries.resolve("stats_filter");
+    Metric cache_bytes(MetricType::Gauge, "metric_cache_bytes",
+                       {MetricTag{"wasm_filter", MetricTag::TagType::String}});
+    cache_bytes_ = cache_bytes.resolve("stats_filter");
     empty_node_info_ = ::Wasm::Common::extractEmptyNodeFlatBuffer();
     if (outbound_) {
       peer_metadata_id_key_ = ::Wasm::Common::kUpstreamMetadataIdKey;
@@ -254,11 +749,12 @@ class PluginRootContext : public RootContext {
   bool configure(size_t);
   bool onDone() override;
   void onTick() override;
-  void report(::Wasm::Common::RequestInfo& request_info, bool end_stream);
+  void report(StreamInfo& stream_info, bool end_stream);
   bool useHostHeaderFallback() const { return use_host_header_fallback_; };
-  void addToRequestQueue(uint32_t context_id,
-                         ::Wasm::Common::RequestInfo* request_info);
+  void addToRequestQueue(uint32_t context_id, StreamInfo* stream_info);
   void deleteFromRequestQueue(uint32_t context_id);
+  // Number of streams to report on the next tick.
+  size_t requestQueueSize() const { return request_queue_.size(); }
 
  protected:
   const std::vector<MetricTag>& defaultTags();
@@ -272,12 +768,39 @@ class PluginRootContext : public RootContext {
   std::optional<size_t> addStringExpression(const std::string& input);
   // Allocate an int expression and return its token if successful.
   std::optional<uint32_t> addIntExpression(const std::string& input);
+  // Return the interned peer node dimensions. Blocks are cached by the peer
+  // ID since peer metadata does not change for a given ID.
+  const std::vector<Symbol>& peerDimensions(
+      const ::Wasm::Common::PeerNodeInfo& peer_node_info);
+  // Return the stat generators for a protocol, recurrent ones first.
+  const std::vector<size_t>& protocolStats(
+      ::Wasm::Common::Protocol protocol) const;
+  // Intern the local node dimensions into the cache key.
+  void internLocalDimensions();
+  // Report the current cache size as deltas, so that the gauges aggregate
+  // across the worker threads.
+  void updateCacheGauges();
 
  private:
   flatbuffers::DetachedBuffer local_node_info_;
   flatbuffers::DetachedBuffer empty_node_info_;
 
   IstioDimensions istio_dimensions_;
+  // Interned form of istio_dimensions_, reused across reports. The local
+  // node positions are set on config load.
+  IstioDimensionsKey istio_dimensions_key_;
+  // Local dimensions and peer_dimensions_ hold a reference to their symbols,
+  // as do the metric cache entries.
+  SymbolTable symbols_;
+  // Maps peer ID to the interned peer dimensions.
+  PeerDimensionsCache peer_dimensions_{symbols_};
+  // Lookup key for peer_dimensions_.
+  std::string peer_id_;
+  // Stamps the cache uses of each report, so that the metric and the peer
+  // entries can be evicted by recency.
+  uint64_t report_count_ = 0;
+  // Peer dimensions for peers without an ID, e.g. upstream host fallback.
+  std::vector<Symbol> fallback_peer_dimensions_;
 
   struct expressionInfo {
     uint32_t token;
@@ -298,15 +821,33 @@ class PluginRootContext : public RootContext {
   int64_t cache_hits_accumulator_ = 0;
   uint32_t cache_hits_;
   uint32_t cache_misses_;
+  uint32_t cache_evictions_;
+  uint32_t cache_entries_;
+  uint32_t cache_bytes_;
+  int64_t reported_cache_entries_ = 0;
+  int64_t reported_cache_bytes_ = 0;
+  size_t max_metric_cache_entries_ = 0;
+  size_t max_metric_cache_bytes_ = 0;
 
   // Resolved metric where value can be recorded.
   // Maps resolved dimensions to a set of related metrics.
-  std::unordered_map<IstioDimensions, std::vector<SimpleStat>,
-                     HashIstioDimensions>
-      metrics_;
-  Map<uint32_t, ::Wasm::Common::RequestInfo*> request_queue_;
+  MetricCache metrics_{symbols_, &peer_dimensions_};
+  // Pending metric values when batching is enabled, flushed on tick.
+  std::unique_ptr<MetricBatch> batch_;
+  // Streams to report on the next tick: gRPC streams for the whole stream
+  // duration, and TCP streams only while they have unreported values.
+  Map<uint32_t, StreamInfo*> request_queue_;
   // Peer stats to be generated for a dimensioned metrics set.
   std::vector<StatGen> stats_;
+  // Indexes into stats_ of the generators matching each protocol, with the
+  // recurrent ones first.
+  std::vector<size_t> tcp_stats_;
+  std::vector<size_t> http_stats_;
+  std::vector<size_t> grpc_stats_;
+  // Optional request info fields read by the configured metrics.
+  uint32_t request_fields_ = ::Wasm::Common::kAllRequestFields;
+  // Reused by StatGen::resolve to build tag-encoded metric names.
+  std::string stat_name_buffer_;
   bool initialized_ = false;
 };
 
@@ -330,20 +871,21 @@ class PluginContext : public Context {
   // Called for both HTTP and TCP streams, as a final data callback.
   void onLog() override {
     rootContext()->deleteFromRequestQueue(id());
-    if (request_info_.request_protocol == ::Wasm::Common::Protocol::TCP) {
-      request_info_.tcp_connections_closed++;
+    if (requestInfo().request_protocol == ::Wasm::Common::Protocol::TCP) {
+      requestInfo().tcp_connections_closed++;
     }
-    rootContext()->report(request_info_, true);
+    rootContext()->report(stream_info_, true);
   };
 
   // HTTP streams start with headers.
   FilterHeadersStatus onRequestHeaders(uint32_t, bool) override {
-    ::Wasm::Common::populateRequestProtocol(&request_info_);
+    ::Wasm::Common::populateRequestProtocol(&requestInfo());
     // Save host value for recurrent reporting.
     // Beware that url_host and any other request headers are only available in
     // this callback and onLog(), certainly not in onTick().
     if (rootContext()->useHostHeaderFallback()) {
-      getValue({"request", "host"}, &request_info_.url_host);
+      ::Wasm::Common::getStringValue({"request", "host"}, &requestInfo(),
+                                     &requestInfo().url_host);
     }
     return FilterHeadersStatus::Continue;
   }
@@ -351,27 +893,37 @@ class PluginContext : public Context {
   // Metadata should be available (if any) at the time of adding to the queue.
   // Since HTTP metadata exchange uses headers in both directions, this is a
   // safe place to register for both inbound and outbound streams.
+  // Only gRPC streams have mid-stream metrics among HTTP streams.
   FilterHeadersStatus onResponseHeaders(uint32_t, bool) override {
-    rootContext()->addToRequestQueue(id(), &request_info_);
+    if (requestInfo().request_protocol == ::Wasm::Common::Protocol::GRPC) {
+      rootContext()->addToRequestQueue(id(), &stream_info_);
+    }
     return FilterHeadersStatus::Continue;
   }
 
   // TCP streams start with new connections.
   FilterStatus onNewConnection() override {
-    request_info_.request_protocol = ::Wasm::Common::Protocol::TCP;
-    request_info_.tcp_connections_opened++;
-    rootContext()->addToRequestQueue(id(), &request_info_);
+    requestInfo().request_protocol = ::Wasm::Common::Protocol::TCP;
+    requestInfo().tcp_connections_opened++;
+    rootContext()->addToRequestQueue(id(), &stream_info_);
     return FilterStatus::Continue;
   }
 
   // Called on onData call, so counting the data that is received.
+  // TCP streams are queued for the next tick only when they moved data.
   FilterStatus onDownstreamData(size_t size, bool) override {
-    request_info_.tcp_received_bytes += size;
+    if (size > 0) {
+      requestInfo().tcp_received_bytes += size;
+      rootContext()->addToRequestQueue(id(), &stream_info_);
+    }
     return FilterStatus::Continue;
   }
   // Called on onWrite call, so counting the data that is sent.
   FilterStatus onUpstreamData(size_t size, bool) override {
-    request_info_.tcp_sent_bytes += size;
+    if (size > 0) {
+      requestInfo().tcp_sent_bytes += size;
+      rootContext()->addToRequestQueue(id(), &stream_info_);
+    }
     return FilterStatus::Continue;
   }
 
@@ -379,8 +931,11 @@ class PluginContext : public Context {
   inline PluginRootContext* rootContext() {
     return dynamic_cast<PluginRootContext*>(this->root());
   };
+  inline ::Wasm::Common::ArenaRequestInfo& requestInfo() {
+    return stream_info_.request_info;
+  }
 
-  ::Wasm::Common::RequestInfo request_info_;
+  StreamInfo stream_info_;
 };
 
 #ifdef NULL_PLUGIN
@@ -0,0 +1,411 @@
+/* Copyright 2020 Istio Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests of the stats plugin report path. The plugin runs in the null VM
+// against a stand-in host that serves the filter state.
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_split.h"
+
+#include "extensions/common/context.h"
+#include "extensions/common/fake_host.h"
+#include "extensions/common/node_info_generated.h"
+#include "extensions/stats/plugin.h"
+#include "gtest/gtest.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace Stats {
+
+using Envoy::Extensions::Testing::FakeHost;
+using Envoy::Extensions::Testing::NullVmPlugin;
+using Envoy::Extensions::Testing::peerFlatNode;
+using Envoy::Extensions::Testing::propertyPath;
+
+// Number of default tags of the request, the gRPC streaming, and the TCP
+// metrics.
+constexpr size_t kRequestTags = 23;
+constexpr size_t kPeerTags = 18;
+constexpr size_t kTcpTags = 21;
+
+// Record of a metric, decoded from its tag-encoded name.
+struct ReportedMetric {
+  absl::flat_hash_map<std::string, std::string> tags;
+  uint64_t value;
+};
+
+class StatsPluginReportTest : public testing::Test {
+ protected:
+  StatsPluginReportTest() {
+    host_.setProperty({"cluster_name"}, "inbound|9080|http|svc.ns");
+    host_.setProperty({"response", "code"}, 200);
+    host_.request_headers[":method"] = "GET";
+    load("stats_inbound", "{}",
+         envoy::config::core::v3::TrafficDirection::INBOUND);
+  }
+
+  void load(std::string_view root_id, std::string_view configuration,
+            envoy::config::core::v3::TrafficDirection direction) {
+    plugin_.reset();
+    plugin_ = std::make_unique<NullVmPlugin>(host_, "envoy.wasm.stats",
+                                             root_id, configuration, direction);
+  }
+
+  void report() {
+    auto stream = plugin_->newStream();
+    stream->onRequestHeaders(1, false);
+    stream->onResponseHeaders(1, false);
+    stream->onLog();
+    stream->onDelete();
+  }
+
+  void reportTcp(size_t received, size_t sent) {
+    auto stream = plugin_->newStream();
+    stream->onNewConnection();
+    stream->onDownstreamData(received, false);
+    stream->onUpstreamData(sent, false);
+    stream->onLog();
+    stream->onDelete();
+  }
+
+  // Returns the records of a metric, e.g. "istio_requests_total", with the
+  // tags encoded in their names by the default separators.
+  std::vector<ReportedMetric> reported(std::string_view name) {
+    std::vector<ReportedMetric> result;
+    for (const auto& [full_name, value] : host_.metric_records) {
+      std::vector<std::string_view> fields = absl::StrSplit(full_name, ";.;");
+      if (fields.back() != name) {
+        continue;
+      }
+      ReportedMetric& metric = result.emplace_back();
+      metric.value = value;
+      fields.pop_back();
+      for (auto field : fields) {
+        std::pair<std::string, std::string> tag = absl::StrSplit(field, "=.=");
+        metric.tags.insert(std::move(tag));
+      }
+    }
+    return result;
+  }
+
+  // Returns the version of the request info shared with the other plugins, or
+  // nothing if the shared buffer is invalid.
+  std::optional<uint32_t> sharedRequestInfoVersion() {
+    const auto& shared =
+        host_.properties[propertyPath({::Wasm::Common::kRequestInfoKey})];
+    flatbuffers::Verifier verifier(
+        reinterpret_cast<const uint8_t*>(shared.data()), shared.size());
+    if (!verifier.VerifyBuffer<::Wasm::Common::FlatRequestInfo>(nullptr)) {
+      return {};
+    }
+    return flatbuffers::GetRoot<::Wasm::Common::FlatRequestInfo>(
+               shared.data())
+        ->version();
+  }
+
+  FakeHost host_;
+  std::unique_ptr<NullVmPlugin> plugin_;
+};
+
+TEST_F(StatsPluginReportTest, ReportsInboundHttp) {
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataIdKey}, "peer-0");
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataKey}, peerFlatNode(0));
+  report();
+
+  auto requests = reported("istio_requests_total");
+  ASSERT_EQ(requests.size(), 1);
+  EXPECT_EQ(requests[0].value, 1);
+  auto& tags = requests[0].tags;
+  EXPECT_EQ(tags["reporter"], "destination");
+  EXPECT_EQ(tags["source_workload"], "peer-workload-0");
+  EXPECT_EQ(tags["source_workload_namespace"], "peer-namespace");
+  EXPECT_EQ(tags["source_app"], "peer-app");
+  EXPECT_EQ(tags["source_version"], "v1");
+  EXPECT_EQ(tags["source_canonical_service"], "peer-workload-0");
+  EXPECT_EQ(tags["destination_workload"], "unknown");
+  EXPECT_EQ(tags["request_protocol"], "http");
+  EXPECT_EQ(tags["response_code"], "200");
+  EXPECT_EQ(tags["grpc_response_status"], "");
+  EXPECT_EQ(tags.size(), kRequestTags);
+  EXPECT_EQ(reported("istio_request_duration_milliseconds").size(), 1);
+  EXPECT_EQ(reported("istio_request_messages_total").size(), 0);
+  EXPECT_EQ(reported("istio_tcp_sent_bytes_total").size(), 0);
+}
+
+TEST_F(StatsPluginReportTest, ReportsOutboundHttp) {
+  load("stats_outbound", "{}",
+       envoy::config::core::v3::TrafficDirection::OUTBOUND);
+  host_.setProperty({::Wasm::Common::kUpstreamMetadataIdKey}, "peer-1");
+  host_.setProperty({::Wasm::Common::kUpstreamMetadataKey}, peerFlatNode(1));
+  host_.setProperty({"response", "code"}, 503);
+  report();
+
+  auto requests = reported("istio_requests_total");
+  ASSERT_EQ(requests.size(), 1);
+  auto& tags = requests[0].tags;
+  EXPECT_EQ(tags["reporter"], "source");
+  EXPECT_EQ(tags["destination_workload"], "peer-workload-1");
+  EXPECT_EQ(tags["destination_workload_namespace"], "peer-namespace");
+  EXPECT_EQ(tags["destination_app"], "peer-app");
+  EXPECT_EQ(tags["destination_version"], "v1");
+  EXPECT_EQ(tags["source_workload"], "unknown");
+  EXPECT_EQ(tags["request_protocol"], "http");
+  EXPECT_EQ(tags["response_code"], "503");
+}
+
+TEST_F(StatsPluginReportTest, ReportsInboundGrpc) {
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataIdKey}, "peer-0");
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataKey}, peerFlatNode(0));
+  host_.setProperty({"response", "grpc_status"}, 14);
+  host_.setProperty({"filter_state", "envoy.filters.http.grpc_stats"}, "3,5");
+  host_.request_headers["content-type"] = "application/grpc";
+  report();
+
+  auto requests = reported("istio_requests_total");
+  ASSERT_EQ(requests.size(), 1);
+  auto& tags = requests[0].tags;
+  EXPECT_EQ(tags["reporter"], "destination");
+  EXPECT_EQ(tags["source_workload"], "peer-workload-0");
+  EXPECT_EQ(tags["request_protocol"], "grpc");
+  EXPECT_EQ(tags["grpc_response_status"], "14");
+
+  // Streaming metrics are only dimensioned by the peers.
+  auto messages = reported("istio_request_messages_total");
+  ASSERT_EQ(messages.size(), 1);
+  EXPECT_EQ(messages[0].value, 3);
+  EXPECT_EQ(messages[0].tags["source_workload"], "peer-workload-0");
+  EXPECT_EQ(messages[0].tags.count("request_protocol"), 0);
+  EXPECT_EQ(messages[0].tags.size(), kPeerTags);
+  messages = reported("istio_response_messages_total");
+  ASSERT_EQ(messages.size(), 1);
+  EXPECT_EQ(messages[0].value, 5);
+}
+
+TEST_F(StatsPluginReportTest, ReportsOutboundGrpc) {
+  load("stats_outbound", "{}",
+       envoy::config::core::v3::TrafficDirection::OUTBOUND);
+  host_.setProperty({::Wasm::Common::kUpstreamMetadataIdKey}, "peer-1");
+  host_.setProperty({::Wasm::Common::kUpstreamMetadataKey}, peerFlatNode(1));
+  host_.setProperty({"response", "grpc_status"}, 0);
+  host_.request_headers["content-type"] = "application/grpc";
+  report();
+
+  auto requests = reported("istio_requests_total");
+  ASSERT_EQ(requests.size(), 1);
+  auto& tags = requests[0].tags;
+  EXPECT_EQ(tags["reporter"], "source");
+  EXPECT_EQ(tags["destination_workload"], "peer-workload-1");
+  EXPECT_EQ(tags["request_protocol"], "grpc");
+  EXPECT_EQ(tags["grpc_response_status"], "0");
+}
+
+TEST_F(StatsPluginReportTest, ReportsInboundTcp) {
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataIdKey}, "peer-0");
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataKey}, peerFlatNode(0));
+  reportTcp(/* received */ 10, /* sent */ 20);
+
+  EXPECT_EQ(reported("istio_requests_total").size(), 0);
+  auto received = reported("istio_tcp_received_bytes_total");
+  ASSERT_EQ(received.size(), 1);
+  EXPECT_EQ(received[0].value, 10);
+  auto& tags = received[0].tags;
+  EXPECT_EQ(tags["reporter"], "destination");
+  EXPECT_EQ(tags["source_workload"], "peer-workload-0");
+  EXPECT_EQ(tags["request_protocol"], "tcp");
+  EXPECT_EQ(tags.count("response_code"), 0);
+  EXPECT_EQ(tags.size(), kTcpTags);
+  auto sent = reported("istio_tcp_sent_bytes_total");
+  ASSERT_EQ(sent.size(), 1);
+  EXPECT_EQ(sent[0].value, 20);
+  auto opened = reported("istio_tcp_connections_opened_total");
+  ASSERT_EQ(opened.size(), 1);
+  EXPECT_EQ(opened[0].value, 1);
+  auto closed = reported("istio_tcp_connections_closed_total");
+  ASSERT_EQ(closed.size(), 1);
+  EXPECT_EQ(closed[0].value, 1);
+}
+
+TEST_F(StatsPluginReportTest, ReportsOutboundTcp) {
+  load("stats_outbound", "{}",
+       envoy::config::core::v3::TrafficDirection::OUTBOUND);
+  host_.setProperty({::Wasm::Common::kUpstreamMetadataIdKey}, "peer-1");
+  host_.setProperty({::Wasm::Common::kUpstreamMetadataKey}, peerFlatNode(1));
+  reportTcp(/* received */ 10, /* sent */ 20);
+
+  auto sent = reported("istio_tcp_sent_bytes_total");
+  ASSERT_EQ(sent.size(), 1);
+  EXPECT_EQ(sent[0].value, 20);
+  auto& tags = sent[0].tags;
+  EXPECT_EQ(tags["reporter"], "source");
+  EXPECT_EQ(tags["destination_workload"], "peer-workload-1");
+  EXPECT_EQ(tags["source_workload"], "unknown");
+  EXPECT_EQ(tags["request_protocol"], "tcp");
+}
+
+TEST_F(StatsPluginReportTest, AppliesDimensionOverrides) {
+  load("stats_inbound", R"({
+    "metrics": [{
+      "name": "requests_total",
+      "dimensions": {
+        "source_app": "'overridden-app'",
+        "custom_tag": "'custom-value'"
+      },
+      "tags_to_remove": ["response_flags", "grpc_response_status"]
+    }]
+  })",
+       envoy::config::core::v3::TrafficDirection::INBOUND);
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataIdKey}, "peer-0");
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataKey}, peerFlatNode(0));
+  report();
+
+  auto requests = reported("istio_requests_total");
+  ASSERT_EQ(requests.size(), 1);
+  auto& tags = requests[0].tags;
+  EXPECT_EQ(tags["source_app"], "overridden-app");
+  EXPECT_EQ(tags["custom_tag"], "custom-value");
+  EXPECT_EQ(tags["source_workload"], "peer-workload-0");
+  EXPECT_EQ(tags.count("response_flags"), 0);
+  EXPECT_EQ(tags.count("grpc_response_status"), 0);
+  EXPECT_EQ(tags.size(), kRequestTags + 1 - 2);
+
+  // Other metrics keep the default tags.
+  auto durations = reported("istio_request_duration_milliseconds");
+  ASSERT_EQ(durations.size(), 1);
+  EXPECT_EQ(durations[0].tags["source_app"], "peer-app");
+  EXPECT_EQ(durations[0].tags.count("custom_tag"), 0);
+  EXPECT_EQ(durations[0].tags.count("response_flags"), 1);
+}
+
+// gRPC streams are reported on every tick until they end, and TCP streams
+// only on the ticks following data.
+TEST_F(StatsPluginReportTest, ReportsQueuedStreamsOnTick) {
+  using PluginRootContext = ::proxy_wasm::null_plugin::Stats::PluginRootContext;
+  auto* root = plugin_->rootContext<PluginRootContext>();
+  ASSERT_NE(root, nullptr);
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataIdKey}, "peer-0");
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataKey}, peerFlatNode(0));
+  host_.request_headers["content-type"] = "application/grpc";
+  const std::initializer_list<std::string_view> grpc_stats = {
+      "filter_state", "envoy.filters.http.grpc_stats"};
+
+  auto grpc = plugin_->newStream();
+  grpc->onRequestHeaders(1, false);
+  grpc->onResponseHeaders(1, false);
+  auto tcp = plugin_->newStream();
+  tcp->onNewConnection();
+  tcp->onDownstreamData(10, false);
+  EXPECT_EQ(root->requestQueueSize(), 2);
+
+  host_.setProperty(grpc_stats, "2,1");
+  plugin_->tick();
+  auto request_messages = reported("istio_request_messages_total");
+  ASSERT_EQ(request_messages.size(), 1);
+  EXPECT_EQ(request_messages[0].value, 2);
+  EXPECT_EQ(request_messages[0].tags["source_workload"], "peer-workload-0");
+  auto response_messages = reported("istio_response_messages_total");
+  ASSERT_EQ(response_messages.size(), 1);
+  EXPECT_EQ(response_messages[0].value, 1);
+  auto received = reported("istio_tcp_received_bytes_total");
+  ASSERT_EQ(received.size(), 1);
+  EXPECT_EQ(received[0].value, 10);
+  EXPECT_EQ(received[0].tags["source_workload"], "peer-workload-0");
+  auto opened = reported("istio_tcp_connections_opened_total");
+  ASSERT_EQ(opened.size(), 1);
+  EXPECT_EQ(opened[0].value, 1);
+  // Only the recurrent metrics are reported mid-stream.
+  EXPECT_EQ(reported("istio_requests_total").size(), 0);
+  EXPECT_EQ(reported("istio_tcp_connections_closed_total").size(), 0);
+  // The TCP stream has nothing left to report, so it leaves the queue.
+  EXPECT_EQ(root->requestQueueSize(), 1);
+
+  // Only the new gRPC messages are reported on the next tick.
+  host_.metric_records.clear();
+  host_.setProperty(grpc_stats, "3,1");
+  plugin_->tick();
+  request_messages = reported("istio_request_messages_total");
+  ASSERT_EQ(request_messages.size(), 1);
+  EXPECT_EQ(request_messages[0].value, 1);
+  EXPECT_EQ(reported("istio_response_messages_total").size(), 0);
+  EXPECT_EQ(reported("istio_tcp_received_bytes_total").size(), 0);
+  EXPECT_EQ(root->requestQueueSize(), 1);
+
+  // New data queues the TCP stream again, for one tick.
+  host_.metric_records.clear();
+  tcp->onUpstreamData(5, false);
+  EXPECT_EQ(root->requestQueueSize(), 2);
+  plugin_->tick();
+  auto sent = reported("istio_tcp_sent_bytes_total");
+  ASSERT_EQ(sent.size(), 1);
+  EXPECT_EQ(sent[0].value, 5);
+  EXPECT_EQ(root->requestQueueSize(), 1);
+
+  tcp->onLog();
+  tcp->onDelete();
+  grpc->onLog();
+  grpc->onDelete();
+  EXPECT_EQ(root->requestQueueSize(), 0);
+}
+
+// A peer ID without the peer metadata is reported with the fallback node.
+TEST_F(StatsPluginReportTest, ReportsPeerIdWithoutMetadata) {
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataIdKey}, "peer-0");
+  report();
+  auto requests = reported("istio_requests_total");
+  ASSERT_EQ(requests.size(), 1);
+  EXPECT_EQ(requests[0].tags["source_workload"], "unknown");
+}
+
+TEST_F(StatsPluginReportTest, ReportsMissingPeer) {
+  host_.setProperty({::Wasm::Common::kDownstreamMetadataIdKey},
+                    ::Wasm::Common::kMetadataNotFoundValue);
+  report();
+  auto requests = reported("istio_requests_total");
+  ASSERT_EQ(requests.size(), 1);
+  EXPECT_EQ(requests[0].tags["source_workload"], "unknown");
+}
+
+// Request info shared by a plugin of another schema is fetched again.
+TEST_F(StatsPluginReportTest, RefetchesInvalidSharedRequestInfo) {
+  host_.setProperty({::Wasm::Common::kRequestInfoKey}, "not a flat buffer");
+  report();
+  EXPECT_GT(host_.records, 0);
+  EXPECT_EQ(sharedRequestInfoVersion(), ::Wasm::Common::kRequestInfoVersion);
+}
+
+TEST_F(StatsPluginReportTest, RefetchesSharedRequestInfoOfOtherVersion) {
+  flatbuffers::FlatBufferBuilder fbb;
+  auto cluster = fbb.CreateString("stale");
+  ::Wasm::Common::FlatRequestInfoBuilder properties(fbb);
+  properties.add_upstream_cluster(cluster);
+  properties.add_version(::Wasm::Common::kRequestInfoVersion + 1);
+  fbb.Finish(properties.Finish());
+  host_.setProperty(
+      {::Wasm::Common::kRequestInfoKey},
+      std::string_view(reinterpret_cast<const char*>(fbb.GetBufferPointer()),
+                       fbb.GetSize()));
+  report();
+  EXPECT_GT(host_.records, 0);
+  EXPECT_EQ(sharedRequestInfoVersion(), ::Wasm::Common::kRequestInfoVersion);
+}
+
+}  // namespace Stats
+}  // namespace Extensions
+}  // namespace Envoy
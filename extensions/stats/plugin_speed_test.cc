@@ -0,0 +1,180 @@
+/* Copyright 2020 Istio Authors. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of the stats plugin report path. The plugin runs in the null VM
+// against a stand-in host that serves canned properties and headers, and
+// only counts metric records, so that the measurements only cover the plugin.
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "absl/strings/str_cat.h"
+#include "benchmark/benchmark.h"
+#include "extensions/common/context.h"
+#include "extensions/common/fake_host.h"
+
+namespace {
+
+// Allocation counter for the allocations/request figures.
+std::atomic<uint64_t> allocations{0};
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+namespace Envoy {
+namespace Extensions {
+namespace Stats {
+
+using Envoy::Extensions::Common::Wasm::Context;
+using Envoy::Extensions::Testing::FakeHost;
+using Envoy::Extensions::Testing::NullVmPlugin;
+using Envoy::Extensions::Testing::peerFlatNode;
+using Envoy::Extensions::Testing::propertyPath;
+
+constexpr std::string_view kPluginConfig = R"EOF({
+  "tcp_reporting_duration": "3600s"
+})EOF";
+
+// StatsPluginBenchmark loads the inbound stats plugin in the null VM.
+class StatsPluginBenchmark {
+ public:
+  explicit StatsPluginBenchmark(size_t cardinality) {
+    for (size_t i = 0; i < cardinality; i++) {
+      peer_ids_.push_back(absl::StrCat("peer-", i));
+      peers_.push_back(peerFlatNode(i));
+    }
+    host_.setProperty({"cluster_name"}, "inbound|9080|http|svc.ns");
+    host_.setProperty({"route_name"}, "default");
+    host_.setProperty({"destination", "port"}, 9080);
+    host_.setProperty({"connection", "uri_san_peer_certificate"},
+                      "spiffe://cluster.local/ns/peer/sa/default");
+    host_.setProperty({"response", "code"}, 200);
+    host_.setProperty({"response", "flags"}, 0);
+    host_.setProperty({"response", "grpc_status"}, 0);
+    host_.setProperty({"request", "duration"}, 1000000);
+    host_.setProperty({"request", "total_size"}, 256);
+    host_.setProperty({"response", "total_size"}, 1024);
+    host_.capture_metrics = false;
+
+    plugin_ = std::make_unique<NullVmPlugin>(
+        host_, "envoy.wasm.stats", "stats_inbound", kPluginConfig,
+        envoy::config::core::v3::TrafficDirection::INBOUND);
+  }
+
+  // Selects the peer of the i-th request. The peer properties are assigned in
+  // place to keep the stand-in host out of the allocation counts.
+  void prepareRequest(size_t i) {
+    size_t peer = i % peers_.size();
+    host_.properties[peer_id_key_].assign(peer_ids_[peer]);
+    host_.properties[peer_key_].assign(peers_[peer]);
+  }
+
+  std::unique_ptr<Context> newStream() { return plugin_->newStream(); }
+
+  FakeHost host_;
+
+ private:
+  const std::string peer_id_key_ =
+      propertyPath({::Wasm::Common::kDownstreamMetadataIdKey});
+  const std::string peer_key_ =
+      propertyPath({::Wasm::Common::kDownstreamMetadataKey});
+  std::vector<std::string> peer_ids_;
+  std::vector<std::string> peers_;
+  std::unique_ptr<NullVmPlugin> plugin_;
+};
+
+void reportCounters(benchmark::State& state, const FakeHost& host,
+                    uint64_t start_allocations) {
+  state.counters["allocs_per_request"] =
+      benchmark::Counter(allocations.load() - start_allocations,
+                         benchmark::Counter::kAvgIterations);
+  state.counters["records_per_request"] =
+      benchmark::Counter(host.records, benchmark::Counter::kAvgIterations);
+}
+
+// Full HTTP stream, reported once at the end of the stream. The argument is
+// the number of distinct peers, which sets the metric cache cardinality.
+static void BM_HttpReport(benchmark::State& state) {
+  StatsPluginBenchmark bench(state.range(0));
+  bench.host_.request_headers[":method"] = "GET";
+  bench.host_.request_headers["content-type"] = "text/plain";
+  size_t i = 0;
+  uint64_t start_allocations = allocations.load();
+  for (auto _ : state) {
+    bench.prepareRequest(i++);
+    auto stream = bench.newStream();
+    stream->onRequestHeaders(2, false);
+    stream->onResponseHeaders(2, false);
+    stream->onLog();
+    stream->onDelete();
+  }
+  reportCounters(state, bench.host_, start_allocations);
+}
+BENCHMARK(BM_HttpReport)->Arg(1)->Arg(100)->Arg(10000);
+
+// gRPC stream, including the message counters from the grpc_stats filter.
+static void BM_GrpcReport(benchmark::State& state) {
+  StatsPluginBenchmark bench(state.range(0));
+  bench.host_.request_headers[":method"] = "POST";
+  bench.host_.request_headers["content-type"] = "application/grpc";
+  bench.host_.setProperty({"filter_state", "envoy.filters.http.grpc_stats"},
+                          "3,5");
+  size_t i = 0;
+  uint64_t start_allocations = allocations.load();
+  for (auto _ : state) {
+    bench.prepareRequest(i++);
+    auto stream = bench.newStream();
+    stream->onRequestHeaders(2, false);
+    stream->onResponseHeaders(2, false);
+    stream->onLog();
+    stream->onDelete();
+  }
+  reportCounters(state, bench.host_, start_allocations);
+}
+BENCHMARK(BM_GrpcReport)->Arg(1)->Arg(100)->Arg(10000);
+
+// Short TCP connection carrying data in both directions.
+static void BM_TcpReport(benchmark::State& state) {
+  StatsPluginBenchmark bench(state.range(0));
+  size_t i = 0;
+  uint64_t start_allocations = allocations.load();
+  for (auto _ : state) {
+    bench.prepareRequest(i++);
+    auto stream = bench.newStream();
+    stream->onNetworkNewConnection();
+    stream->onDownstreamData(512, false);
+    stream->onUpstreamData(2048, false);
+    stream->onLog();
+    stream->onDelete();
+  }
+  reportCounters(state, bench.host_, start_allocations);
+}
+BENCHMARK(BM_TcpReport)->Arg(1)->Arg(100)->Arg(10000);
+
+}  // namespace Stats
+}  // namespace Extensions
+}  // namespace Envoy
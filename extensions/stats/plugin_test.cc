@@ -67,20 +67,228 @@ TEST(IstioDimensions, Hash) {
   d8[source_version] = "v2";
   d8[grpc_response_status] = "12";
 
-  // Must be unique except for d7 and d8.
+  // Must be unique except for d7 and d7_duplicate.
+  SymbolTable table;
   std::set<size_t> hashes;
-  hashes.insert(HashIstioDimensions()(d1));
-  hashes.insert(HashIstioDimensions()(d2));
-  hashes.insert(HashIstioDimensions()(d3));
-  hashes.insert(HashIstioDimensions()(d4));
-  hashes.insert(HashIstioDimensions()(d5));
-  hashes.insert(HashIstioDimensions()(d6));
-  hashes.insert(HashIstioDimensions()(d7));
-  hashes.insert(HashIstioDimensions()(d7_duplicate));
-  hashes.insert(HashIstioDimensions()(d8));
+  for (const auto* d :
+       {&d1, &d2, &d3, &d4, &d5, &d6, &d7, &d7_duplicate, &d8}) {
+    IstioDimensionsKey key;
+    key.assign(*d, table);
+    hashes.insert(HashIstioDimensionsKey()(key));
+  }
   EXPECT_EQ(hashes.size(), 8);
 }
 
+TEST(IstioDimensions, KeyEquality) {
+  SymbolTable table;
+  IstioDimensions d1(count_standard_labels);
+  d1[request_protocol] = "grpc";
+  d1[response_code] = "200";
+  IstioDimensions d2 = d1;
+  IstioDimensions d3 = d1;
+  d3[response_code] = "400";
+
+  IstioDimensionsKey k1, k2, k3;
+  k1.assign(d1, table);
+  k2.assign(d2, table);
+  k3.assign(d3, table);
+  EXPECT_EQ(k1, k2);
+  EXPECT_FALSE(k1 == k3);
+
+  // Empty, "grpc", "200", and "400".
+  EXPECT_EQ(table.size(), 4);
+  EXPECT_EQ(table.value(table.intern("grpc")), "grpc");
+
+  // Re-assigning reuses the key storage.
+  k3.assign(d1, table);
+  EXPECT_EQ(k1, k3);
+  EXPECT_EQ(k3.size(), count_standard_labels);
+}
+
+TEST(MetricCache, EvictsLeastRecentlyUsed) {
+  SymbolTable table;
+  std::vector<IstioDimensionsKey> keys(4);
+  for (size_t i = 0; i < keys.size(); i++) {
+    IstioDimensions d(count_standard_labels);
+    d[response_code] = std::to_string(200 + i);
+    keys[i].assign(d, table);
+  }
+  auto stats = [](uint32_t id) {
+    ResolvedStats resolved;
+    resolved.stats.push_back(SimpleStat(id, ValueExtractor::RequestCount,
+                                        nullptr, MetricType::Counter,
+                                        /* recurrent */ false));
+    return resolved;
+  };
+
+  MetricCache cache(table);
+  cache.setLimits(/* max_entries */ 2, /* max_bytes */ 0);
+  EXPECT_EQ(cache.insert(keys[0], stats(0)), 0);
+  EXPECT_EQ(cache.insert(keys[1], stats(1)), 0);
+  // Touch the oldest entry so that the second one is evicted next.
+  ASSERT_NE(cache.find(keys[0]), nullptr);
+  EXPECT_EQ(cache.insert(keys[2], stats(2)), 1);
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.find(keys[1]), nullptr);
+  ASSERT_NE(cache.find(keys[0]), nullptr);
+  EXPECT_EQ(cache.find(keys[0])->stats.at(0).metric_id_, 0);
+  ASSERT_NE(cache.find(keys[2]), nullptr);
+
+  // A byte budget below a single entry still keeps the latest insertion.
+  size_t bytes = cache.bytes();
+  cache.setLimits(0, 1);
+  EXPECT_EQ(cache.insert(keys[3], stats(3)), 2);
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_EQ(cache.bytes(), bytes / 2);
+  ASSERT_NE(cache.find(keys[3]), nullptr);
+
+  // Evictions release the values only used by the evicted keys.
+  EXPECT_EQ(table.size(), 2);
+
+  cache.clear();
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.bytes(), 0);
+  EXPECT_EQ(table.size(), 0);
+  EXPECT_EQ(table.bytes(), 0);
+}
+
+TEST(SymbolTable, ReleasesUnreferencedValues) {
+  SymbolTable table;
+  Symbol a = table.intern("a");
+  Symbol b = table.intern("b");
+  table.ref(a);
+  table.ref(a);
+  table.ref(b);
+  EXPECT_EQ(table.size(), 2);
+  size_t bytes = table.bytes();
+
+  table.unref(b);
+  EXPECT_EQ(table.size(), 1);
+  EXPECT_LT(table.bytes(), bytes);
+  EXPECT_EQ(table.intern("a"), a);
+  // The released slot is reused by the next new value.
+  EXPECT_EQ(table.intern("c"), b);
+  EXPECT_EQ(table.value(b), "c");
+
+  table.unref(a);
+  EXPECT_EQ(table.value(a), "a");
+  table.unref(a);
+  EXPECT_EQ(table.size(), 1);
+}
+
+TEST(MetricCache, ByteBudgetIncludesSymbols) {
+  SymbolTable table;
+  std::vector<IstioDimensionsKey> keys(3);
+  for (size_t i = 0; i < keys.size(); i++) {
+    IstioDimensions d(count_standard_labels);
+    d[destination_workload] = std::string(1024, 'a' + i);
+    keys[i].assign(d, table);
+  }
+
+  MetricCache cache(table);
+  EXPECT_EQ(cache.insert(keys[0], ResolvedStats()), 0);
+  size_t budget = cache.bytes() + table.bytes();
+  // Two entries fit in the budget by entry size, but not with their values.
+  cache.setLimits(0, budget + cache.bytes());
+  EXPECT_EQ(cache.insert(keys[1], ResolvedStats()), 1);
+  EXPECT_EQ(cache.find(keys[0]), nullptr);
+  EXPECT_LE(cache.bytes() + table.bytes(), budget + cache.bytes());
+  EXPECT_EQ(cache.insert(keys[2], ResolvedStats()), 1);
+  EXPECT_EQ(cache.size(), 1);
+  ASSERT_NE(cache.find(keys[2]), nullptr);
+}
+
+TEST(PeerDimensionsCache, EvictsLeastRecentlyUsedPeer) {
+  SymbolTable table;
+  auto dimensions = [&table](std::string_view workload) {
+    return std::vector<Symbol>{table.intern(workload), table.intern("ns")};
+  };
+
+  PeerDimensionsCache cache(table);
+  cache.setMaxEntries(2);
+  cache.insert("a", dimensions("workload-a"), 1);
+  cache.insert("b", dimensions("workload-b"), 2);
+  // Touch the oldest peer so that the other one is evicted next.
+  ASSERT_NE(cache.find("a", 3), nullptr);
+  const auto& c = cache.insert("c", dimensions("workload-c"), 4);
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.find("b"), nullptr);
+  ASSERT_NE(cache.find("a", 5), nullptr);
+  EXPECT_EQ(table.value(cache.find("a", 5)->at(0)), "workload-a");
+  EXPECT_EQ(table.value(c.at(0)), "workload-c");
+  EXPECT_EQ(cache.oldest(), 4);
+
+  // Only the values of the evicted peer are released.
+  EXPECT_EQ(table.size(), 3);
+  cache.clear();
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.bytes(), 0);
+  EXPECT_EQ(table.size(), 0);
+}
+
+TEST(MetricCache, ByteBudgetEvictsPeersByRecency) {
+  SymbolTable table;
+  PeerDimensionsCache peers(table);
+  MetricCache cache(table, &peers);
+  const std::string workload_a(1024, 'a');
+  const std::string workload_b(1024, 'b');
+  auto key = [&table](const std::string& workload, std::string_view code) {
+    IstioDimensions d(count_standard_labels);
+    d[source_workload] = workload;
+    d[response_code] = std::string(code);
+    IstioDimensionsKey k;
+    k.assign(d, table);
+    return k;
+  };
+
+  // Peer "a" is used by the oldest metric, and peer "b" by the newer one.
+  peers.insert("a", {table.intern(workload_a)}, 1);
+  EXPECT_EQ(cache.insert(key(workload_a, "200"), ResolvedStats(), 1), 0);
+  peers.insert("b", {table.intern(workload_b)}, 2);
+  EXPECT_EQ(cache.insert(key(workload_b, "200"), ResolvedStats(), 2), 0);
+
+  // Beyond the budget, the oldest metric goes first, and then the peer "a",
+  // which is older than the metrics of the peer "b" and releases its values.
+  cache.setLimits(0, cache.totalBytes());
+  ASSERT_NE(peers.find("b", 3), nullptr);
+  EXPECT_EQ(cache.insert(key(workload_b, "503"), ResolvedStats(), 3), 2);
+  EXPECT_EQ(peers.size(), 1);
+  EXPECT_EQ(peers.find("a"), nullptr);
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_NE(cache.find(key(workload_b, "200")), nullptr);
+  EXPECT_NE(cache.find(key(workload_b, "503")), nullptr);
+  // Empty, workload_b, "200", and "503".
+  EXPECT_EQ(table.size(), 4);
+
+  cache.clear();
+  peers.clear();
+  EXPECT_EQ(table.size(), 0);
+}
+
+TEST(ValueExtractor, FlushesRecurrentValues) {
+  ::Wasm::Common::ArenaRequestInfo request_info;
+  request_info.duration = 5000000;
+  request_info.tcp_sent_bytes = 10;
+  request_info.request_message_count = 3;
+  EXPECT_EQ(extractValue(ValueExtractor::RequestCount, request_info), 1);
+  EXPECT_EQ(extractValue(ValueExtractor::RequestDuration, request_info), 5);
+  EXPECT_EQ(extractValue(ValueExtractor::TCPSentBytes, request_info), 10);
+  EXPECT_EQ(extractValue(ValueExtractor::TCPSentBytes, request_info), 0);
+  EXPECT_EQ(extractValue(ValueExtractor::RequestMessages, request_info), 3);
+  EXPECT_EQ(extractValue(ValueExtractor::RequestMessages, request_info), 0);
+  EXPECT_EQ(extractValue(ValueExtractor::Custom, request_info), 0);
+}
+
+TEST(MetricBatch, AccumulatesByMetric) {
+  MetricBatch batch(/* max_size */ 2);
+  EXPECT_FALSE(batch.add(1, MetricType::Counter, 3));
+  EXPECT_FALSE(batch.add(1, MetricType::Counter, 4));
+  EXPECT_EQ(batch.size(), 1);
+  EXPECT_TRUE(batch.add(2, MetricType::Gauge, 5));
+  EXPECT_TRUE(batch.add(2, MetricType::Gauge, 6));
+  EXPECT_EQ(batch.size(), 2);
+}
+
 }  // namespace Stats
 
 // WASM_EPILOG
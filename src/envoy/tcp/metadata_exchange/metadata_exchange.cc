@@ -15,6 +15,7 @@
 
 #include "src/envoy/tcp/metadata_exchange/metadata_exchange.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
 
@@ -22,9 +23,12 @@
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
 #include "common/buffer/buffer_impl.h"
-#include "common/protobuf/utility.h"
+#include "common/common/empty_string.h"
+#include "envoy/buffer/buffer.h"
 #include "envoy/network/connection.h"
 #include "envoy/stats/scope.h"
+#include "google/protobuf/arena.h"
+#include "google/protobuf/io/zero_copy_stream.h"
 #include "src/envoy/tcp/metadata_exchange/metadata_exchange_initial_header.h"
 
 namespace Envoy {
@@ -32,7 +36,7 @@ namespace Tcp {
 namespace MetadataExchange {
 namespace {
 
-std::unique_ptr<::Envoy::Buffer::OwnedImpl> constructProxyHeaderData(
+std::string constructProxyHeaderData(
     const Envoy::ProtobufWkt::Any& proxy_data) {
   MetadataExchangeInitialHeader initial_header;
   std::string proxy_data_str = proxy_data.SerializeAsString();
@@ -42,15 +46,92 @@ std::unique_ptr<::Envoy::Buffer::OwnedImpl> constructProxyHeaderData(
       absl::ghtonl(MetadataExchangeInitialHeader::magic_number);
   initial_header.data_size = absl::ghtonl(proxy_data_str.length());
 
-  ::Envoy::Buffer::OwnedImpl initial_header_buffer{
-      absl::string_view(reinterpret_cast<const char*>(&initial_header),
-                        sizeof(MetadataExchangeInitialHeader))};
-  auto proxy_data_buffer =
-      std::make_unique<::Envoy::Buffer::OwnedImpl>(proxy_data_str);
-  proxy_data_buffer->prepend(initial_header_buffer);
-  return proxy_data_buffer;
+  std::string frame(reinterpret_cast<const char*>(&initial_header),
+                    sizeof(MetadataExchangeInitialHeader));
+  frame.append(proxy_data_str);
+  return frame;
 }
 
+// Buffer fragment referencing a shared frame, which is released together with
+// the last fragment.
+class SharedFrameFragment : public Buffer::BufferFragment {
+ public:
+  explicit SharedFrameFragment(std::shared_ptr<const std::string> frame)
+      : frame_(std::move(frame)) {}
+
+  // Buffer::BufferFragment
+  const void* data() const override { return frame_->data(); }
+  size_t size() const override { return frame_->size(); }
+  void done() override { delete this; }
+
+ private:
+  const std::shared_ptr<const std::string> frame_;
+};
+
+// Reads the leading bytes of a buffer in place, across its slices, so that
+// protobuf messages are parsed without linearizing or copying the buffer.
+class BufferSliceInputStream
+    : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  BufferSliceInputStream(const Buffer::Instance& data, uint64_t length)
+      : slices_(data.getRawSlices()), remaining_(length) {}
+
+  bool Next(const void** data, int* size) override {
+    if (position_ == current_size_) {
+      while (index_ < slices_.size() && remaining_ > 0 &&
+             slices_[index_].len_ == 0) {
+        index_++;
+      }
+      if (index_ == slices_.size() || remaining_ == 0) {
+        return false;
+      }
+      const auto& slice = slices_[index_++];
+      current_ = static_cast<const char*>(slice.mem_);
+      current_size_ = std::min<uint64_t>(slice.len_, remaining_);
+      remaining_ -= current_size_;
+      position_ = 0;
+    }
+    *data = current_ + position_;
+    *size = static_cast<int>(current_size_ - position_);
+    byte_count_ += current_size_ - position_;
+    position_ = current_size_;
+    return true;
+  }
+
+  void BackUp(int count) override {
+    position_ -= count;
+    byte_count_ -= count;
+  }
+
+  bool Skip(int count) override {
+    const void* data;
+    int size;
+    while (count > 0) {
+      if (!Next(&data, &size)) {
+        return false;
+      }
+      if (size > count) {
+        BackUp(size - count);
+        return true;
+      }
+      count -= size;
+    }
+    return true;
+  }
+
+  int64_t ByteCount() const override { return byte_count_; }
+
+ private:
+  const Buffer::RawSliceVector slices_;
+  size_t index_{0};
+  const char* current_{nullptr};
+  uint64_t current_size_{0};
+  uint64_t position_{0};
+  // Bytes of the limit not yet handed out from the slices.
+  uint64_t remaining_;
+  int64_t byte_count_{0};
+};
+
 bool serializeToStringDeterministic(const google::protobuf::Struct& metadata,
                                     std::string* metadata_bytes) {
   google::protobuf::io::StringOutputStream md(metadata_bytes);
@@ -183,6 +264,20 @@ void MetadataExchangeFilter::writeNodeMetadata() {
     return;
   }
 
+  const auto frame = config_->localMetadataFrame(
+      [this]() { return buildLocalMetadataFrame(); });
+  if (frame != nullptr) {
+    ::Envoy::Buffer::OwnedImpl buf;
+    buf.addBufferFragment(*new SharedFrameFragment(frame));
+    write_callbacks_->injectWriteDataToFilterChain(buf, false);
+    config_->stats().metadata_added_.inc();
+  }
+
+  conn_state_ = ReadingInitialHeader;
+}
+
+std::shared_ptr<const std::string>
+MetadataExchangeFilter::buildLocalMetadataFrame() {
   Envoy::ProtobufWkt::Struct data;
   Envoy::ProtobufWkt::Struct* metadata =
       (*data.mutable_fields())[ExchangeMetadataHeader].mutable_struct_value();
@@ -196,15 +291,15 @@ void MetadataExchangeFilter::writeNodeMetadata() {
     Envoy::ProtobufWkt::Any metadata_any_value;
     *metadata_any_value.mutable_type_url() = StructTypeUrl;
     std::string serialized_data;
-    serializeToStringDeterministic(data, &serialized_data);
+    if (!serializeToStringDeterministic(data, &serialized_data)) {
+      ENVOY_LOG(warn, "Failed to serialize the local node metadata.");
+      return nullptr;
+    }
     *metadata_any_value.mutable_value() = serialized_data;
-    std::unique_ptr<::Envoy::Buffer::OwnedImpl> buf =
-        constructProxyHeaderData(metadata_any_value);
-    write_callbacks_->injectWriteDataToFilterChain(*buf, false);
-    config_->stats().metadata_added_.inc();
+    return std::make_shared<const std::string>(
+        constructProxyHeaderData(metadata_any_value));
   }
-
-  conn_state_ = ReadingInitialHeader;
+  return nullptr;
 }
 
 void MetadataExchangeFilter::tryReadInitialProxyHeader(Buffer::Instance& data) {
@@ -250,11 +345,16 @@ void MetadataExchangeFilter::tryReadProxyData(Buffer::Instance& data) {
     conn_state_ = NeedMoreDataProxyHeader;
     return;
   }
-  std::string proxy_data_buf =
-      std::string(static_cast<const char*>(data.linearize(proxy_data_length_)),
-                  proxy_data_length_);
-  Envoy::ProtobufWkt::Any proxy_data;
-  if (!proxy_data.ParseFromString(proxy_data_buf)) {
+  // Parse in place from the buffer slices, with both messages on an arena.
+  BufferSliceInputStream input(data, proxy_data_length_);
+  google::protobuf::Arena arena;
+  auto* proxy_data =
+      google::protobuf::Arena::CreateMessage<Envoy::ProtobufWkt::Any>(&arena);
+  auto* metadata =
+      google::protobuf::Arena::CreateMessage<Envoy::ProtobufWkt::Struct>(
+          &arena);
+  if (!proxy_data->ParseFromZeroCopyStream(&input) ||
+      !proxy_data->UnpackTo(metadata)) {
     config_->stats().header_not_found_.inc();
     setMetadataNotFoundFilterState();
     ENVOY_LOG(warn,
@@ -265,34 +365,53 @@ void MetadataExchangeFilter::tryReadProxyData(Buffer::Instance& data) {
   data.drain(proxy_data_length_);
 
   // Set Metadata
-  Envoy::ProtobufWkt::Struct value_struct =
-      Envoy::MessageUtil::anyConvert<Envoy::ProtobufWkt::Struct>(proxy_data);
+  const Envoy::ProtobufWkt::Struct& value_struct = *metadata;
+  const auto key_metadata_id_it =
+      value_struct.fields().find(ExchangeMetadataHeaderId);
+  const std::string& peer_id =
+      key_metadata_id_it != value_struct.fields().end()
+          ? key_metadata_id_it->second.string_value()
+          : EMPTY_STRING;
   auto key_metadata_it = value_struct.fields().find(ExchangeMetadataHeader);
   if (key_metadata_it != value_struct.fields().end()) {
-    updatePeer(key_metadata_it->second.struct_value());
+    updatePeer(peer_id, key_metadata_it->second.struct_value());
   }
-  const auto key_metadata_id_it =
-      value_struct.fields().find(ExchangeMetadataHeaderId);
   if (key_metadata_id_it != value_struct.fields().end()) {
-    Envoy::ProtobufWkt::Value val = key_metadata_id_it->second;
     updatePeerId(config_->filter_direction_ == FilterDirection::Downstream
                      ? ::Wasm::Common::kDownstreamMetadataIdKey
                      : ::Wasm::Common::kUpstreamMetadataIdKey,
-                 val.string_value());
+                 peer_id);
   }
 }
 
 void MetadataExchangeFilter::updatePeer(
+    const std::string& peer_id,
     const Envoy::ProtobufWkt::Struct& struct_value) {
-  const auto fb = ::Wasm::Common::extractNodeFlatBufferFromStruct(struct_value);
+  auto& cache = ::Wasm::Common::SharedPeerCache::get();
+  ::Wasm::Common::PeerNodePtr node;
+  if (!peer_id.empty()) {
+    node = cache.find(peer_id);
+  }
+  if (node != nullptr) {
+    config_->stats().peer_cache_hit_.inc();
+  } else {
+    const auto fb =
+        ::Wasm::Common::extractNodeFlatBufferFromStruct(struct_value);
+    node = std::make_shared<const std::string>(
+        reinterpret_cast<const char*>(fb.data()), fb.size());
+    if (!peer_id.empty()) {
+      config_->stats().peer_cache_miss_.inc();
+      size_t evicted = cache.insert(std::string(peer_id), node);
+      config_->stats().peer_cache_eviction_.add(evicted);
+    }
+  }
 
   // Filter object captures schema by view, hence the global singleton for the
   // prototype.
   auto state =
       std::make_unique<::Envoy::Extensions::Filters::Common::Expr::CelState>(
           MetadataExchangeConfig::nodeInfoPrototype());
-  state->setValue(
-      absl::string_view(reinterpret_cast<const char*>(fb.data()), fb.size()));
+  state->setValue(*node);
 
   auto key = config_->filter_direction_ == FilterDirection::Downstream
                  ? ::Wasm::Common::kDownstreamMetadataKey
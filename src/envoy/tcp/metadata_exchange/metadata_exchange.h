@@ -15,6 +15,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
 
 #include "common/protobuf/protobuf.h"
@@ -26,6 +29,7 @@
 #include "envoy/stream_info/filter_state.h"
 #include "extensions/common/context.h"
 #include "extensions/common/node_info_bfbs_generated.h"
+#include "extensions/common/peer_cache.h"
 #include "extensions/common/proto_util.h"
 #include "extensions/filters/common/expr/cel_state.h"
 #include "src/envoy/tcp/metadata_exchange/config/metadata_exchange.pb.h"
@@ -44,7 +48,10 @@ using ::Envoy::Extensions::Filters::Common::Expr::CelStatePrototype;
   COUNTER(alpn_protocol_found)               \
   COUNTER(initial_header_not_found)          \
   COUNTER(header_not_found)                  \
-  COUNTER(metadata_added)
+  COUNTER(metadata_added)                    \
+  COUNTER(peer_cache_hit)                    \
+  COUNTER(peer_cache_miss)                   \
+  COUNTER(peer_cache_eviction)
 
 /**
  * Struct definition for all MetadataExchange stats. @see stats_macros.h
@@ -82,6 +89,26 @@ class MetadataExchangeConfig {
   // Stats for MetadataExchange Filter.
   MetadataExchangeStats stats_;
 
+  // Returns the framed local node metadata written to the peers, or nullptr
+  // if it could not be built. It is built once by the first connection and
+  // shared by all of them, since the local node does not change for the life
+  // of the config. A failed build is not cached, so that the next connection
+  // builds the frame again.
+  template <typename Builder>
+  std::shared_ptr<const std::string> localMetadataFrame(Builder build) {
+    // The frame is never changed once built.
+    if (local_metadata_frame_built_.load(std::memory_order_acquire)) {
+      return local_metadata_frame_;
+    }
+    std::lock_guard<std::mutex> lock(local_metadata_frame_mutex_);
+    if (local_metadata_frame_ == nullptr) {
+      local_metadata_frame_ = build();
+      local_metadata_frame_built_.store(local_metadata_frame_ != nullptr,
+                                        std::memory_order_release);
+    }
+    return local_metadata_frame_;
+  }
+
   static const CelStatePrototype& nodeInfoPrototype() {
     static const CelStatePrototype* const prototype = new CelStatePrototype(
         true,
@@ -92,6 +119,10 @@ class MetadataExchangeConfig {
   }
 
  private:
+  std::mutex local_metadata_frame_mutex_;
+  std::atomic<bool> local_metadata_frame_built_{false};
+  std::shared_ptr<const std::string> local_metadata_frame_;
+
   MetadataExchangeStats generateStats(const std::string& prefix,
                                       Stats::Scope& scope) {
     return MetadataExchangeStats{
@@ -135,6 +166,10 @@ class MetadataExchangeFilter : public Network::Filter,
   // filters.
   void writeNodeMetadata();
 
+  // Builds the initial header and the proxy data carrying the local node
+  // metadata, or nullptr if there is nothing to write.
+  std::shared_ptr<const std::string> buildLocalMetadataFrame();
+
   // Tries to read inital proxy header in the data bytes.
   void tryReadInitialProxyHeader(Buffer::Instance& data);
 
@@ -142,8 +177,10 @@ class MetadataExchangeFilter : public Network::Filter,
   // form of google::protobuf::any which encapsulates google::protobuf::struct.
   void tryReadProxyData(Buffer::Instance& data);
 
-  // Helper function to share the metadata with other filters.
-  void updatePeer(const Envoy::ProtobufWkt::Struct& struct_value);
+  // Helper function to share the metadata with other filters. Peers with an ID
+  // are decoded once per process through the shared peer cache.
+  void updatePeer(const std::string& peer_id,
+                  const Envoy::ProtobufWkt::Struct& struct_value);
   void updatePeerId(absl::string_view key, absl::string_view value);
 
   // Helper function to get Dynamic metadata.
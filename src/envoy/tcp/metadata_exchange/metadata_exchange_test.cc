@@ -125,6 +125,74 @@ TEST_F(MetadataExchangeFilterTest, MetadataExchangeFound) {
   EXPECT_EQ(1UL, config_->stats().alpn_protocol_found_.value());
 }
 
+TEST_F(MetadataExchangeFilterTest, MetadataExchangeFoundAcrossSlices) {
+  initialize();
+  initializeStructValues();
+
+  EXPECT_CALL(read_filter_callbacks_.connection_, nextProtocol())
+      .WillRepeatedly(Return("istio2"));
+
+  ::Envoy::Buffer::OwnedImpl serialized;
+  MetadataExchangeInitialHeader initial_header;
+  Envoy::ProtobufWkt::Any productpage_any_value;
+  *productpage_any_value.mutable_type_url() =
+      "type.googleapis.com/google.protobuf.Struct";
+  *productpage_any_value.mutable_value() =
+      productpage_value_.SerializeAsString();
+  ConstructProxyHeaderData(serialized, productpage_any_value, &initial_header);
+  serialized.add("world");
+
+  // Proxy data is parsed in place, so split it over many small slices.
+  const std::string bytes = serialized.toString();
+  ::Envoy::Buffer::OwnedImpl data;
+  for (size_t i = 0; i < bytes.size(); i += 3) {
+    data.appendSliceForTest(absl::string_view(bytes).substr(i, 3));
+  }
+
+  EXPECT_EQ(Envoy::Network::FilterStatus::Continue,
+            filter_->onData(data, false));
+  EXPECT_EQ(data.toString(), "world");
+
+  EXPECT_EQ(0UL, config_->stats().initial_header_not_found_.value());
+  EXPECT_EQ(0UL, config_->stats().header_not_found_.value());
+  EXPECT_EQ(1UL, config_->stats().alpn_protocol_found_.value());
+}
+
+TEST_F(MetadataExchangeFilterTest, MetadataExchangePeerCache) {
+  initialize();
+  initializeStructValues();
+
+  EXPECT_CALL(read_filter_callbacks_.connection_, nextProtocol())
+      .WillRepeatedly(Return("istio2"));
+
+  // Peers are cached process wide, so the peer ID is unique to this test.
+  Envoy::ProtobufWkt::Struct proxy_data;
+  (*proxy_data.mutable_fields())["x-envoy-peer-metadata-id"].set_string_value(
+      "productpage-peer-cache");
+  *(*proxy_data.mutable_fields())["x-envoy-peer-metadata"]
+       .mutable_struct_value() = productpage_value_;
+  Envoy::ProtobufWkt::Any proxy_data_any;
+  *proxy_data_any.mutable_type_url() =
+      "type.googleapis.com/google.protobuf.Struct";
+  *proxy_data_any.mutable_value() = proxy_data.SerializeAsString();
+
+  // The first connection decodes the peer, the second one finds it cached.
+  for (int i = 0; i < 2; i++) {
+    filter_ = std::make_unique<MetadataExchangeFilter>(config_, local_info_);
+    filter_->initializeReadFilterCallbacks(read_filter_callbacks_);
+    filter_->initializeWriteFilterCallbacks(write_filter_callbacks_);
+    ::Envoy::Buffer::OwnedImpl data;
+    MetadataExchangeInitialHeader initial_header;
+    ConstructProxyHeaderData(data, proxy_data_any, &initial_header);
+    EXPECT_EQ(Envoy::Network::FilterStatus::Continue,
+              filter_->onData(data, false));
+  }
+
+  EXPECT_EQ(0UL, config_->stats().header_not_found_.value());
+  EXPECT_EQ(1UL, config_->stats().peer_cache_miss_.value());
+  EXPECT_EQ(1UL, config_->stats().peer_cache_hit_.value());
+}
+
 TEST_F(MetadataExchangeFilterTest, MetadataExchangeNotFound) {
   initialize();
 
@@ -137,6 +205,29 @@ TEST_F(MetadataExchangeFilterTest, MetadataExchangeNotFound) {
   EXPECT_EQ(1UL, config_->stats().alpn_protocol_not_found_.value());
 }
 
+// A failed build of the local metadata frame is retried by the next
+// connection, and a built one is reused.
+TEST_F(MetadataExchangeFilterTest, LocalMetadataFrameRetriedAfterFailure) {
+  initialize();
+
+  int builds = 0;
+  auto failed = [&builds]() -> std::shared_ptr<const std::string> {
+    builds++;
+    return nullptr;
+  };
+  auto built = [&builds]() {
+    builds++;
+    return std::make_shared<const std::string>("frame");
+  };
+  EXPECT_EQ(config_->localMetadataFrame(failed), nullptr);
+  EXPECT_EQ(config_->localMetadataFrame(failed), nullptr);
+  auto frame = config_->localMetadataFrame(built);
+  ASSERT_NE(frame, nullptr);
+  EXPECT_EQ(*frame, "frame");
+  EXPECT_EQ(config_->localMetadataFrame(failed), frame);
+  EXPECT_EQ(builds, 3);
+}
+
 }  // namespace MetadataExchange
 }  // namespace Tcp
 }  // namespace Envoy